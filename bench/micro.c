@@ -0,0 +1,254 @@
+//--------------------------------------------------------------------------------------
+// Microbenchmarks of the shell's hot paths; repl.c is built in with its main renamed.
+// Every result is printed as one JSON object per line.
+//--------------------------------------------------------------------------------------
+#define main repl_main
+#include "../repl.c"
+#undef main
+
+#define LINES 1000000
+#define LOOKUPS 10000000
+#define COMMANDS 200000
+#define LONG_ARGS 50000
+#define LONG_LINES 200
+#define PATHS 10000
+#define PATH_PREFIX 4096
+#define SPAWNS 2000
+#define SPAWN_HEAP (1L << 30)
+
+char *line = "echo one two \"three four\" five >/dev/null\n";
+
+//--------------------------------------------------------------------------------------
+// Seconds since start
+//--------------------------------------------------------------------------------------
+double since(struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+//--------------------------------------------------------------------------------------
+// Print one result
+//--------------------------------------------------------------------------------------
+void result(char *name, char *unit, double value) {
+    printf("{\"name\": \"%s\", \"unit\": \"%s\", \"value\": %.1f}\n", name, unit, value);
+    fflush(stdout);
+}
+//--------------------------------------------------------------------------------------
+// Lines per second through the buffered reader
+//--------------------------------------------------------------------------------------
+void bench_reader() {
+    struct timespec start;
+    struct reader r;
+    size_t len, n = 0, size = strlen(line);
+    int i, fd = memfd_create("bench", MFD_CLOEXEC);
+    char *buf = (char *) malloc(size * 1000);
+    for (i = 0; i < 1000; i++) {
+        memcpy(buf + i * size, line, size);
+    }
+    for (i = 0; i < LINES / 1000; i++) {
+        if (write(fd, buf, size * 1000) < 0) {
+            perror("write");
+            exit(EXIT_FAILURE);
+        }
+    }
+    lseek(fd, 0, SEEK_SET);
+    reader_init(&r, fd);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while (read_line(&r, &len) != NULL) {
+        n++;
+    }
+    result("reader", "lines/s", n / since(&start));
+    free(r.buf);
+    free(buf);
+    close(fd);
+}
+//--------------------------------------------------------------------------------------
+// Lines per second through tokenize and parse, with the copy read_line would make
+//--------------------------------------------------------------------------------------
+void bench_tokenize() {
+    struct timespec start;
+    size_t size = strlen(line);
+    char buf[256];
+    int i;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < LINES; i++) {
+        memcpy(buf, line, size + 1);
+        if (tokenize(buf, size)) {
+            parse();
+        }
+        arena_reset();
+    }
+    result("tokenize", "lines/s", LINES / since(&start));
+}
+//--------------------------------------------------------------------------------------
+// Symbols per second through tokenize, on lines of LONG_ARGS plain and quoted symbols
+//--------------------------------------------------------------------------------------
+void bench_tokenize_long() {
+    char *words[] = {"argument ", "\"two words\" ", "x ", "it\\'s ", "'single quoted' ", "a\"b\"c "};
+    struct timespec start;
+    size_t size = 0, len;
+    char *buf = (char *) malloc(LONG_ARGS * 16 + 2), *work = (char *) malloc(LONG_ARGS * 16 + 2);
+    int i;
+    for (i = 0; i < LONG_ARGS; i++) {
+        len = strlen(words[i % 6]);
+        memcpy(buf + size, words[i % 6], len);
+        size += len;
+    }
+    buf[size++] = '\n';
+    buf[size] = '\0';
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < LONG_LINES; i++) {
+        memcpy(work, buf, size + 1);
+        if (!tokenize(work, size) || token_count != LONG_ARGS) {
+            fprintf(stderr, "tokenize: %d symbols instead of %d\n", token_count, LONG_ARGS);
+            break;
+        }
+        arena_reset();
+    }
+    result("tokenize_long", "symbols/s", (double) LONG_LINES * LONG_ARGS / since(&start));
+    free(buf);
+    free(work);
+}
+//--------------------------------------------------------------------------------------
+// Builtin lookups per second, over every builtin and a few external commands
+//--------------------------------------------------------------------------------------
+void bench_find_builtin() {
+    char *names[B_COUNT + 4] = {"ls", "cat", "grep", "true"};
+    struct timespec start;
+    int i, n = B_COUNT + 4, found = 0;
+    for (i = 0; i < B_COUNT; i++) {
+        names[i + 4] = builtins[i].name;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < LOOKUPS; i++) {
+        found += find_builtin(names[i % n]) >= 0;
+    }
+    result("find_builtin", "lookups/s", LOOKUPS / since(&start));
+    if (found == 0) {
+        fprintf(stderr, "no builtin found\n");
+    }
+}
+//--------------------------------------------------------------------------------------
+// Builtin commands per second through eval, output redirected like in scripts
+//--------------------------------------------------------------------------------------
+void bench_eval() {
+    struct timespec start;
+    size_t size = strlen(line);
+    char buf[256];
+    int i;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < COMMANDS; i++) {
+        memcpy(buf, line, size + 1);
+        if (tokenize(buf, size)) {
+            eval();
+        }
+        arena_reset();
+    }
+    result("eval_builtin", "commands/s", COMMANDS / since(&start));
+}
+//--------------------------------------------------------------------------------------
+// Lines per second echoed through the output writer, like a script's echo lines
+//--------------------------------------------------------------------------------------
+void bench_echo() {
+    char *echo = "echo one two \"three four\" five\n";
+    struct timespec start;
+    size_t size = strlen(echo);
+    char buf[256];
+    FILE *saved = out;
+    int i;
+    if ((out = fopen("/dev/null", "w")) == NULL) {
+        perror("fopen");
+        exit(EXIT_FAILURE);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < LINES; i++) {
+        memcpy(buf, echo, size + 1);
+        if (tokenize(buf, size)) {
+            eval();
+        }
+        arena_reset();
+    }
+    out_close();
+    result("echo", "lines/s", LINES / since(&start));
+    out = saved;
+}
+//--------------------------------------------------------------------------------------
+// Paths per second through sort_names, on paths under one PATH_PREFIX long directory
+// like linkindex sorts them
+//--------------------------------------------------------------------------------------
+void bench_sort_paths() {
+    struct dir_entry *paths = (struct dir_entry *) malloc(PATHS * sizeof(struct dir_entry));
+    struct dir_entry *tmp = (struct dir_entry *) malloc(PATHS * sizeof(struct dir_entry));
+    char *names = (char *) malloc((size_t) PATHS * (PATH_PREFIX + 16));
+    struct timespec start;
+    int i;
+    for (i = 0; i < PATHS; i++) {
+        char *name = names + (size_t) i * (PATH_PREFIX + 16);
+        memset(name, 'd', PATH_PREFIX);
+        snprintf(name + PATH_PREFIX, 16, "/f%u", (unsigned) (i * 2654435761u) % PATHS);
+        paths[i].name = name;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    sort_names(paths, tmp, PATHS, 0);
+    result("sort_paths", "paths/s", PATHS / since(&start));
+    for (i = 1; i < PATHS; i++) {
+        if (strcmp(paths[i - 1].name, paths[i].name) > 0) {
+            fprintf(stderr, "sort_names: %s after %s\n", paths[i].name + PATH_PREFIX, paths[i - 1].name + PATH_PREFIX);
+            break;
+        }
+    }
+    free(paths);
+    free(tmp);
+    free(names);
+}
+//--------------------------------------------------------------------------------------
+// Microseconds per external command started and waited for, with the shell's own heap
+// and again with SPAWN_HEAP of it resident: the launch must not copy the parent
+//--------------------------------------------------------------------------------------
+double spawn_latency() {
+    char *argv[] = {"true", NULL};
+    struct timespec start;
+    int i, stat;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < SPAWNS; i++) {
+        pid_t pid = spawn(argv, -1, -1, NULL, 0);
+        if (pid < 0 || waitpid(pid, &stat, 0) < 0) {
+            fprintf(stderr, "spawn: true failed\n");
+            break;
+        }
+    }
+    return since(&start) / SPAWNS * 1e6;
+}
+void bench_spawn() {
+    int fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    FILE *saved = out;
+    if (fd < 0 || (out = fdopen(fd, "w")) == NULL) {
+        perror("/dev/null");
+        exit(EXIT_FAILURE);
+    }
+    result("spawn_heap_small", "us", spawn_latency());
+    char *heap = (char *) malloc(SPAWN_HEAP);
+    if (heap == NULL) {
+        perror("malloc");
+    } else {
+        memset(heap, 1, SPAWN_HEAP);
+        result("spawn_heap_1g", "us", spawn_latency());
+        free(heap);
+    }
+    out_close();
+    out = saved;
+}
+
+int main(int argc, char *argv[]) {
+    out = stdout;
+    err = stderr;
+    bench_reader();
+    bench_tokenize();
+    bench_tokenize_long();
+    bench_find_builtin();
+    bench_eval();
+    bench_echo();
+    bench_sort_paths();
+    bench_spawn();
+    return 0;
+}
@@ -0,0 +1,132 @@
+#!/bin/bash
+# End-to-end benchmarks of the shell plus the microbenchmarks, as one JSON document.
+# usage: bench/run.sh path/to/repl path/to/micro
+#   BENCH_DIR      fixtures, kept between runs (default /tmp/repl-bench)
+#   BENCH_RUNS     runs per measurement, the best one is reported (default 3)
+#   BENCH_SIZES    cpcat file sizes (default "1M 64M 1G 4G")
+#   BENCH_STAGES   pipes stage counts (default "2 4 8")
+#   BENCH_ENTRIES  files in the dirlist directory (default 1000000)
+#   BENCH_SPAWNS   external commands started by the spawn benchmark (default 100000)
+set -e
+REPL=$(realpath "$1")
+MICRO=$(realpath "$2")
+DIR=${BENCH_DIR:-/tmp/repl-bench}
+RUNS=${BENCH_RUNS:-3}
+SIZES=${BENCH_SIZES:-1M 64M 1G 4G}
+STAGES=${BENCH_STAGES:-2 4 8}
+ENTRIES=${BENCH_ENTRIES:-1000000}
+SPAWNS=${BENCH_SPAWNS:-100000}
+mkdir -p "$DIR"
+cd "$DIR"
+
+results=()
+# record name unit value
+record() {
+    results+=("{\"name\": \"$1\", \"unit\": \"$2\", \"value\": $3}")
+    echo "$1: $3 $2" >&2
+}
+# best wall time in seconds of running the shell on a script, over BENCH_RUNS runs;
+# read from the standard input, or named on the command line with "file"
+best() {
+    local script=$1 mode=$2 best= i start end t
+    for ((i = 0; i < RUNS; i++)); do
+        start=$(date +%s%N)
+        if [ "$mode" = file ]; then
+            "$REPL" "$script" < /dev/null > /dev/null
+        else
+            "$REPL" < "$script" > /dev/null
+        fi
+        end=$(date +%s%N)
+        t=$((end - start))
+        if [ -z "$best" ] || [ $t -lt $best ]; then
+            best=$t
+        fi
+    done
+    echo "$best"
+}
+# rate per second of count things done in ns nanoseconds
+rate() {
+    awk -v n="$1" -v ns="$2" 'BEGIN { printf "%.1f", n / (ns / 1e9) }'
+}
+bytes() {
+    numfmt --from=iec "$1"
+}
+
+#--------------------------------------------------------------------------------------
+# microbenchmarks
+#--------------------------------------------------------------------------------------
+while read -r line; do
+    results+=("$line")
+    echo "$line" >&2
+done < <("$MICRO")
+
+#--------------------------------------------------------------------------------------
+# script mode: lines per second through reader, tokenize and builtin dispatch
+#--------------------------------------------------------------------------------------
+if [ ! -f lines.sh ]; then
+    yes 'echo one two "three four" five' | head -n 1000000 > lines.sh
+fi
+record script_lines lines/s "$(rate 1000000 "$(best lines.sh)")"
+record script_file_lines lines/s "$(rate 1000000 "$(best lines.sh file)")"
+
+#--------------------------------------------------------------------------------------
+# external commands in the foreground: spawn and wait latency; the microbenchmarks
+# measure it again with a large heap in the shell
+#--------------------------------------------------------------------------------------
+if [ ! -f spawn.sh ] || [ "$(wc -l < spawn.sh)" != "$SPAWNS" ]; then
+    yes true | head -n "$SPAWNS" > spawn.sh
+fi
+record spawn_latency us "$(awk -v n="$SPAWNS" -v ns="$(best spawn.sh)" 'BEGIN { printf "%.1f", ns / n / 1e3 }')"
+
+#--------------------------------------------------------------------------------------
+# cpcat file to file, and file to pipe
+#--------------------------------------------------------------------------------------
+for size in $SIZES; do
+    if [ ! -f "data.$size" ]; then
+        head -c "$(bytes "$size")" /dev/urandom > "data.$size"
+    fi
+    echo "cpcat data.$size copy.$size" > cpcat.sh
+    record "cpcat_file_$size" MB/s "$(rate "$(($(bytes "$size") / 1000000))" "$(best cpcat.sh)")"
+    rm -f "copy.$size"
+    echo "pipes \"cpcat data.$size\" \"cpcat\"" > cpcat.sh
+    record "cpcat_pipe_$size" MB/s "$(rate "$(($(bytes "$size") / 1000000))" "$(best cpcat.sh)")"
+done
+
+#--------------------------------------------------------------------------------------
+# pipes: builtin stages (threads) and external stages (processes)
+#--------------------------------------------------------------------------------------
+size=$(echo $SIZES | awk '{ print $(NF > 1 ? 2 : 1) }')
+for n in $STAGES; do
+    for kind in cpcat cat; do
+        line="pipes \"cpcat data.$size\""
+        for ((i = 1; i < n; i++)); do
+            line="$line \"$kind\""
+        done
+        echo "$line" > pipes.sh
+        record "pipes_${kind}_$n" MB/s "$(rate "$(($(bytes "$size") / 1000000))" "$(best pipes.sh)")"
+    done
+done
+
+#--------------------------------------------------------------------------------------
+# dirlist on a directory with BENCH_ENTRIES files
+#--------------------------------------------------------------------------------------
+if [ "$(cat entries/.count 2>/dev/null)" != "$ENTRIES" ]; then
+    rm -rf entries
+    mkdir entries
+    (cd entries && seq -f "file%.0f" 1 "$ENTRIES" | xargs touch && echo "$ENTRIES" > .count)
+fi
+for mode in "" "-s" "-l"; do
+    echo "dirlist $mode entries" > dirlist.sh
+    record "dirlist${mode/-/_}" entries/s "$(rate "$ENTRIES" "$(best dirlist.sh)")"
+done
+
+#--------------------------------------------------------------------------------------
+# one document
+#--------------------------------------------------------------------------------------
+version=$(git -C "$(dirname "$REPL")" describe --always --dirty 2>/dev/null || echo unknown)
+printf '{\n  "version": "%s",\n  "date": "%s",\n  "host": "%s",\n  "cpus": %d,\n  "runs": %d,\n  "results": [\n' \
+    "$version" "$(date -u +%Y-%m-%dT%H:%M:%SZ)" "$(uname -srm)" "$(nproc)" "$RUNS"
+for ((i = 0; i < ${#results[@]}; i++)); do
+    printf '    %s%s\n' "${results[i]}" "$([ $i -lt $((${#results[@]} - 1)) ] && echo ,)"
+done
+printf '  ]\n}\n'
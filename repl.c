@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -9,97 +10,826 @@
 #include <sys/wait.h>
 #include <fcntl.h>
 #include <ctype.h>
+#include <spawn.h>
+#include <limits.h>
+#include <sys/sendfile.h>
+#include <pthread.h>
+#include <poll.h>
+#include <time.h>
+#include <stdint.h>
+#include <sys/signalfd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/pidfd.h>
+#include <sys/sysmacros.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/uio.h>
+#include <stdio_ext.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
 
 //--------------------------------------------------------------------------------------
 // Global variables
 //--------------------------------------------------------------------------------------
-char *name = "mysh";
-char **tokens;
-int token_count;
-int *opt;
-char *cwd;
-int status = 0;
-char ***split;
-int *count;
+__thread char *name = "mysh";
+__thread char *name_copy;
+__thread char **tokens;
+__thread int token_count;
+__thread int *opt;
+__thread int status = 0;
+__thread char ***split;
+__thread int *count;
+__thread struct stage *stages;
+// standard input, output and error of the builtin that is running on this thread
+__thread int in = 0;
+__thread FILE *out;
+__thread FILE *err;
+// what builtins print through the shell's own buffer, written at command boundaries
+__thread struct writer *output;
+// directory relative paths start from, the shell's or a session's, and its path; both
+// change only with dir
+__thread int cwdfd = AT_FDCWD;
+__thread char *cwd;
+extern char **environ;
+
+//--------------------------------------------------------------------------------------
+// Redirections of the standard descriptors, in the order they were written
+//--------------------------------------------------------------------------------------
+struct redirect {
+    int fd;         // 0, 1 or 2
+    int flags;      // how the file is opened
+    int dup;        // or the descriptor that is copied, when path is NULL
+    char *path;
+};
+__thread struct redirect *redirects;
+__thread int redirect_count;
+// symbols that started quoted or escaped are never redirections; NULL when none did
+__thread char *literal;
+
+//--------------------------------------------------------------------------------------
+// Copy engine
+//--------------------------------------------------------------------------------------
+#define COPY_BUF (128 * 1024)
+#define COPY_CHUNK (1 << 30)
+#define COPY_ALIGN 4096
+
+//--------------------------------------------------------------------------------------
+// Pipeline stages that run as threads of the shell
+//--------------------------------------------------------------------------------------
+struct stage {
+    pthread_t thread;
+    int started;
+    pid_t pid;
+    int status;
+    int b;
+    int in;
+    int out;
+    FILE *err;
+    int cwdfd;
+    char *cwd;
+    int args;
+    char **argv;
+};
+
+//--------------------------------------------------------------------------------------
+// Worker pool that runs backgrounded builtins inside the shell
+//--------------------------------------------------------------------------------------
+#define WORKERS 4
+
+struct task {
+    struct task *next;
+    int b;
+    int args;
+    char **argv;
+    int in;
+    int out;
+    int err;
+    int cwdfd;
+    char *cwd;
+    int job;
+    int status;
+};
+struct task *task_head, *task_tail, *task_done;
+int task_pending;
+int task_event = -1;
+pthread_mutex_t task_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t task_ready = PTHREAD_COND_INITIALIZER;
+pthread_cond_t task_idle = PTHREAD_COND_INITIALIZER;
+pthread_t workers[WORKERS];
+int worker_count;
+
+//--------------------------------------------------------------------------------------
+// Job table: background commands, reaped through a signalfd by the main loop
+//--------------------------------------------------------------------------------------
+#define JOB_BUCKETS 1024
+#define JOB_KEEP 64
+
+struct job {
+    struct job *prev;
+    struct job *next;
+    struct job *hash;
+    int id;
+    pid_t pid;
+    int done;
+    int status;
+    int type;
+    struct timespec start;
+    struct timespec end;
+    char *cmd;
+};
+struct job *job_first, *job_last, *job_pids[JOB_BUCKETS];
+int job_running, job_finished;
+int sigfd = -1;
+int interactive;
+
+//--------------------------------------------------------------------------------------
+// Batches of commands run by parallel, at most N at a time
+//--------------------------------------------------------------------------------------
+#define PARALLEL_WINDOW 4   // finished commands held back for ordering, per running one
+
+struct batch {
+    pid_t pid;
+    int pidfd;
+    int out;
+    int status;
+    int done;
+};
+
+//--------------------------------------------------------------------------------------
+// Script files: mapped and run a line at a time, never read into the heap whole
+//--------------------------------------------------------------------------------------
+#define SCRIPT_DROP (8 << 20)       // the part already run is unmapped in steps this big
+
+//--------------------------------------------------------------------------------------
+// Compiled scripts: tokens, builtin ids and flags of every command, keyed by content
+//--------------------------------------------------------------------------------------
+#define CACHE_MAGIC "myshc03"
+
+struct cache_header {
+    char magic[8];
+    uint64_t hash;
+    uint64_t size;
+    uint32_t builtins;
+    uint32_t commands;
+};
+// followed by count token offsets and the tokens, padded to 8 bytes: the arguments,
+// then one symbol per redirection: the descriptor, how (< > >> <> or >& as < > + = &)
+// and the file or the descriptor copied
+struct cache_command {
+    uint32_t size;
+    int16_t b;
+    uint8_t opt;
+    uint32_t args;
+    uint32_t count;
+    uint32_t offset[];
+};
+// a line that didn't parse: its one symbol is what was reported, opt 1 if it failed
+#define CACHE_ERROR -2
+char *cache_dir;
+
+//--------------------------------------------------------------------------------------
+// Buffered output straight to a descriptor
+//--------------------------------------------------------------------------------------
+#define WRITER_BUF 65536
+
+struct writer {
+    int fd;
+    size_t used;
+    int error;
+    // the shell's output writer: the stream it is bound to, and whether each command's
+    // output goes out right away
+    FILE *stream;
+    int eager;
+    char buf[WRITER_BUF];
+};
+
+//--------------------------------------------------------------------------------------
+// Directory listing
+//--------------------------------------------------------------------------------------
+#define DIRENT_BUF (1 << 20)
+#define SORT_SMALL 32
+
+struct dir_entry {
+    char *name;
+    size_t off;
+    unsigned char type;
+};
+
+//--------------------------------------------------------------------------------------
+// Tree walk: directory-scanning threads that steal directories from each other
+//--------------------------------------------------------------------------------------
+#define WALK_THREADS 16
+#define WALK_DEQUE 256
+#define INDEX_SHARDS 64
+#define INDEX_BUCKETS 1024
+
+// directories waiting to be scanned: the owner works at the tail, thieves at the head
+struct walk_deque {
+    pthread_mutex_t lock;
+    char **items;
+    size_t head;
+    size_t tail;
+    size_t cap;
+};
+// (dev, ino) -> every path of the file, split in shards with a lock each
+struct link_path {
+    struct link_path *next;
+    char path[];
+};
+struct link_node {
+    struct link_node *next;
+    dev_t dev;
+    ino_t ino;
+    size_t count;
+    struct link_path *paths;
+};
+struct link_shard {
+    pthread_mutex_t lock;
+    struct link_node **buckets;
+    size_t size;
+    size_t count;
+};
+struct walk {
+    int threads;
+    // the directory and error stream of the builtin that walks
+    int cwdfd;
+    FILE *err;
+    struct walk_deque deques[WALK_THREADS];
+    long pending;
+    int stop;
+    // directories or entries that couldn't be read: the results are partial
+    int errors;
+    // threads with nothing to steal sleep until a directory is queued or the walk ends
+    pthread_mutex_t idle_lock;
+    pthread_cond_t idle;
+    int sleeping;
+    // called for every entry that is not a directory
+    void (*visit)(struct walk *, int, char *, struct dirent64 *, dev_t);
+    // linklist: the file and the links found so far
+    dev_t dev;
+    ino_t ino;
+    nlink_t nlink;
+    pthread_mutex_t lock;
+    struct dir_entry *found;
+    size_t count;
+    size_t cap;
+    // linkindex
+    struct link_shard *shards;
+};
+struct walk_thread {
+    pthread_t thread;
+    struct walk *w;
+    int id;
+};
+
+//--------------------------------------------------------------------------------------
+// batch ... end: file system builtins queued and submitted together through io_uring
+//--------------------------------------------------------------------------------------
+#define BATCH_DEPTH 256
+#define BATCH_SET 8192
+#define KEY_TOUCHED 1
+#define KEY_ABOVE 2
+
+struct fs_op {
+    int b;
+    int res;
+    // relative paths start from the directory the shell was in when it was queued; dir
+    // flushes the queue before it moves, so the descriptor is still open at the flush
+    int dirfd;
+    char *path[2];
+    // absolute, lexically normalized paths the operation changes or reads
+    char *key[2];
+};
+// the paths used by the queued operations and their parent directories
+struct fs_key {
+    char *key;
+    size_t len;
+    int kind;
+};
+struct ring {
+    int fd;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    // the mappings, to take the ring down
+    char *sq;
+    char *cq;
+    size_t sq_size;
+    size_t cq_size;
+    size_t sqes_size;
+};
+int batching;
+struct ring uring = {.fd = -1};
+struct fs_op fs_ops[BATCH_DEPTH];
+int fs_count;
+struct fs_key fs_set[BATCH_SET];
+int fs_used[BATCH_SET / 2];
+int fs_keys;
+
+//--------------------------------------------------------------------------------------
+// Command path cache
+//--------------------------------------------------------------------------------------
+#define HASH_SIZE 256
+
+struct hash_entry {
+    struct hash_entry *next;
+    char *name;
+    char *path;
+    int hits;
+};
+struct hash_entry *hash_table[HASH_SIZE];
+char *hash_path;
+// sessions look commands up at the same time
+pthread_mutex_t hash_lock = PTHREAD_MUTEX_INITIALIZER;
+
+//--------------------------------------------------------------------------------------
+// Buffered input
+//--------------------------------------------------------------------------------------
+#define READER_CHUNK 65536
+
+struct reader {
+    int fd;
+    char *buf;
+    size_t size;
+    size_t start;
+    size_t end;
+    int eof;
+};
+struct reader input;
+// the script is read from the standard input the commands inherit: 1 when it can be
+// handed back at the unread position, -1 when it can't
+int input_shared = 0;
+
+//--------------------------------------------------------------------------------------
+// Per-command arena: everything a command line allocates lives here
+//--------------------------------------------------------------------------------------
+#define ARENA_BLOCK 65536
+#define ARENA_ALIGN 16
+
+struct arena_block {
+    struct arena_block *next;
+    size_t size;
+    size_t used;
+    char data[];
+};
+__thread struct arena_block *arena;
+
+//--------------------------------------------------------------------------------------
+// Server mode: sessions on a unix socket, read by an epoll loop, run by a thread pool
+//--------------------------------------------------------------------------------------
+#define SERVE_THREADS 16    // sessions wait for their external commands, so more than CPUs
+#define SERVE_EVENTS 64
+
+// everything a session keeps between its commands, loaded into the thread running it
+struct session {
+    struct session *next;
+    int fd;
+    struct reader r;
+    int cwdfd;
+    char *cwd;
+    char *name;
+    char *name_copy;
+    int status;
+    FILE *out;
+    FILE *err;
+    int closing;
+};
+struct session *serve_head, *serve_tail;
+pthread_mutex_t serve_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t serve_ready = PTHREAD_COND_INITIALIZER;
+int serve_epoll = -1;
+int serve_null = -1;
+__thread struct session *session;
+
+//--------------------------------------------------------------------------------------
+// Zygote: a small process forked at startup that starts external commands for the shell
+//--------------------------------------------------------------------------------------
+#define ZYGOTE_MSG (128 * 1024)     // longer command lines are spawned by the shell itself
+
+int zygote = -1;
+pthread_mutex_t zygote_lock = PTHREAD_MUTEX_INITIALIZER;
+
+//--------------------------------------------------------------------------------------
+// Captures: command output kept in memfds by name, shared by the shell and its sessions
+//--------------------------------------------------------------------------------------
+struct capture {
+    struct capture *next;
+    char *name;
+    int fd;
+};
+struct capture *captures;
+pthread_mutex_t capture_lock = PTHREAD_MUTEX_INITIALIZER;
 
 //--------------------------------------------------------------------------------------
 // Function prototypes
 //--------------------------------------------------------------------------------------
-int tokenize(char *);
+void reader_init(struct reader *, int);
+char *read_line(struct reader *, size_t *);
+int input_claim(int);
+void *arena_alloc(size_t);
+void arena_reset();
+void arena_free();
+struct arena_block *arena_mark(size_t *);
+void arena_release(struct arena_block *, size_t);
+int tokenize(char *, size_t);
+int lex(char *, size_t);
+int is_space(char);
+size_t next_special(uint64_t *, size_t, size_t);
+void classify(char *, size_t, uint64_t *);
+void classify_scalar(char *, size_t, uint64_t *);
+void classify_tail(char *, size_t, size_t, uint64_t *);
+#if defined(__x86_64__)
+void classify_sse2(char *, size_t, uint64_t *);
+void classify_avx2(char *, size_t, uint64_t *);
+#endif
+#ifdef TOKENIZE_CHECK
+int tokenize_scalar(char *, size_t);
+void tokenize_check(char *, size_t, int);
+void tokenize_fuzz(long);
+#endif
 void eval();
-void set_cwd();
-void fun_name(int);
-void fun_help();
-void fun_status();
-void fun_exit(int);
-void fun_print(int);
-void fun_echo(int);
-void fun_pid();
-void fun_ppid();
-void fun_dir(int);
-void fun_dirwhere();
-void fun_dirmake();
-void fun_dirremove();
-void fun_dirlist(int);
-void fun_linkhard();
-void fun_linksoft();
-void fun_linkread();
-void fun_linklist();
-void fun_unlink();
-void fun_rename();
-void fun_cpcat(int);
-void fun_pipes(int);
+int parse();
+int redirect_scan(char *, struct redirect *);
+int redirect_open(int *, int *);
+FILE *redirect_stream(int, int *, int);
+void execute(int, int);
+int set_cwd(char *);
+int cwd_join(char *, char *, char *);
+int find_builtin(char *);
+int fun_name(int);
+int fun_help(int);
+int fun_status(int);
+int fun_exit(int);
+int fun_print(int);
+int fun_echo(int);
+int fun_pid(int);
+int fun_ppid(int);
+int fun_dir(int);
+int fun_dirwhere(int);
+int fun_dirmake(int);
+int fun_dirremove(int);
+int fun_dirlist(int);
+void dirlist_long(struct writer *, int, struct dir_entry *, size_t);
+void sort_names(struct dir_entry *, struct dir_entry *, size_t, size_t);
+void writer_init(struct writer *, int);
+void writer_put(struct writer *, char *, size_t);
+int writer_flush(struct writer *);
+void writer_putv(struct writer *, struct iovec *, int);
+struct writer *out_writer();
+int out_end(struct writer *);
+void out_flush();
+void out_close();
+void out_switch(FILE *, int);
+int out_eager(FILE *);
+int print_args(int, char *);
+int fun_linkhard(int);
+int fun_linksoft(int);
+int fun_linkread(int);
+int fun_linklist(int);
+int fun_linkindex(int);
+int walk_tree(struct walk *, char *);
+void *walk_run(void *);
+void walk_push(struct walk *, int, char *);
+char *walk_pop(struct walk *, int);
+void walk_idle(struct walk *);
+void walk_wake(struct walk *, int);
+void walk_scan(struct walk *, int, char *, char *);
+void walk_link(struct walk *, int, char *, struct dirent64 *, dev_t);
+void walk_index(struct walk *, int, char *, struct dirent64 *, dev_t);
+struct link_node *index_find(struct link_shard *, dev_t, ino_t);
+void index_free(struct link_shard *);
+void print_paths(struct writer *, struct dir_entry *, size_t);
+int fun_unlink(int);
+int fun_rename(int);
+int fun_batch(int);
+int fun_end(int);
+void fs_queue(int, int);
+int fs_flush();
+char *fs_normalize(char *, char *);
+int fs_find(char *, size_t);
+void fs_mark(char *, size_t, int);
+int fs_conflict(char *);
+void ring_setup();
+void ring_submit();
+int ring_reap();
+void ring_close(int, int);
+int fs_run(struct fs_op *);
+int fun_cpcat(int);
+int fun_pipes(int);
+off_t copy_fd(int, int);
+off_t copy_file(int, int, struct stat *, struct stat *);
+off_t copy_range(int, int, off_t *, off_t *, off_t);
+off_t copy_buffered(int, int, off_t *, off_t *, off_t);
 void pipe_start(int[], int);
 void pipe_middle(int[], int[], int);
 void pipe_end(int[], int);
-void fun_exec_front(int *);
-void fun_exec_back(int *);
-void handler(int);
+int stage_inline(int);
+void stage_start(int, int, int, int);
+void *stage_run(void *);
+int task_submit(int, int, int);
+void *worker(void *);
+void tasks_forget();
+void tasks_wait();
+void tasks_reap();
+void task_release(struct task *);
+unsigned hash_name(char *);
+char *hash_lookup(char *);
+void hash_remove(char *);
+void hash_clear();
+int hash_copy(char *, char *, int);
+int fun_hash(int);
+pid_t spawn(char **, int, int, struct redirect *, int);
+int spawn_blame(struct redirect *, int);
+void fun_exec_front(int, struct redirect *, int);
+void fun_exec_back(int, struct redirect *, int);
 int fun_exec_internal(int);
+int exit_status(int);
+struct job *job_add(pid_t, int);
+struct job *job_find(char *);
+struct job *job_by_id(int);
+void job_finish(struct job *, int);
+void job_remove(struct job *);
+void jobs_reap();
+void jobs_poll(int);
+void jobs_notify();
+int job_wait(struct job *);
+int fun_jobs(int);
+int fun_wait(int);
+int fun_fg(int);
+int fun_parallel(int);
+uint64_t cache_hash(char *, size_t);
+char *cache_compile(char *, size_t, uint64_t, size_t *);
+void cache_save(char *, char *, size_t);
+char *cache_load(char *, uint64_t, size_t, size_t *);
+int cache_valid(char *, size_t);
+char *cache_add(char *, size_t *, size_t *, int, int, int);
+int cache_script(int);
+int script_run(int);
+void cache_path(char *, size_t, char *, uint64_t, char *);
+void cache_run(char *);
+int cache_mkdir(char *);
+pid_t batch_start(struct batch *, int, int);
+int batch_wait(struct batch *, struct pollfd *, int, int, int);
+int fun_time(int);
+int fun_stats(int);
+void stat_add(unsigned long *, unsigned long);
+void stat_command(int, struct timespec *, struct timespec *);
+void stat_bound(char *, size_t, int);
+int fun_debug(int);
+uint64_t trace_start();
+void trace_end(int, char *, uint64_t);
+void trace_release();
+int trace_dump(char *);
+void report(char *);
+void child_exit(int);
+int serve(char *);
+void session_open(int);
+void *serve_run(void *);
+void session_run(struct session *);
+void session_reply(struct session *);
+int session_send(struct session *, int, char *, size_t);
+void session_close(struct session *);
+FILE *session_stream(char *);
+int spawn_exec(pid_t *, char *, posix_spawn_file_actions_t *, posix_spawnattr_t *, char **, int, int, int);
+void zygote_start();
+void zygote_run(int);
+int zygote_spawn(pid_t *, char *, char **, int, int);
+void zygote_forget();
+int fun_capture(int);
+struct capture **capture_find(char *);
+int capture_keep(char *, int);
+int capture_open(char *);
+
+//--------------------------------------------------------------------------------------
+// Builtin registry
+//--------------------------------------------------------------------------------------
+#define BI_BACK 1   // runs asynchronously when the command ends with &
+#define BI_SAFE 2   // does not touch shell state, so it may run inside the shell
+#define BI_BATCH 4  // a single file system call that batch ... end may queue
+#define BI_SHELL 8  // needs the job table or the batch queue, which sessions don't have
+#define BI_OUT 16   // prints through the output writer only
+
+enum {
+    B_NAME, B_HELP, B_STATUS, B_EXIT, B_PRINT, B_ECHO, B_PID, B_PPID, B_DIR,
+    B_DIRWHERE, B_DIRMAKE, B_DIRREMOVE, B_DIRLIST, B_LINKHARD, B_LINKSOFT,
+    B_LINKREAD, B_LINKLIST, B_UNLINK, B_RENAME, B_CPCAT, B_PIPES, B_HASH, B_JOBS,
+    B_WAIT, B_FG, B_PARALLEL, B_LINKINDEX, B_BATCH, B_END, B_TIME, B_STATS, B_DEBUG,
+    B_CAPTURE, B_COUNT
+};
+
+struct builtin {
+    char *name;
+    int (*fun)(int);
+    int args;
+    int flags;
+    char *description;
+};
+
+struct builtin builtins[B_COUNT] = {
+    {"name",      fun_name,      0, 0,                 "Print or change shell name"},
+    {"help",      fun_help,      0, BI_SAFE | BI_OUT,  "Print short help"},
+    {"status",    fun_status,    0, BI_SAFE,           "Print last command status"},
+    {"exit",      fun_exit,      0, 0,                 "Exit from shell"},
+    {"print",     fun_print,     0, BI_SAFE | BI_OUT,  "Print arguments"},
+    {"echo",      fun_echo,      0, BI_SAFE | BI_OUT,  "Print arguments and newline"},
+    {"pid",       fun_pid,       0, BI_BACK,           "Print PID"},
+    {"ppid",      fun_ppid,      0, BI_BACK,           "Print PPID"},
+    {"dir",       fun_dir,       0, 0,                 "Change directory"},
+    {"dirwhere",  fun_dirwhere,  0, BI_BACK | BI_SAFE, "Print current working directory"},
+    {"dirmake",   fun_dirmake,   1, BI_BACK | BI_SAFE | BI_BATCH, "Make directory"},
+    {"dirremove", fun_dirremove, 1, BI_BACK | BI_SAFE | BI_BATCH, "Remove directory"},
+    {"dirlist",   fun_dirlist,   0, BI_BACK | BI_SAFE | BI_OUT, "List directory (-l long, -s sorted)"},
+    {"linkhard",  fun_linkhard,  2, BI_BACK | BI_SAFE | BI_BATCH, "Create hard link"},
+    {"linksoft",  fun_linksoft,  2, BI_BACK | BI_SAFE | BI_BATCH, "Create symbolic/soft link"},
+    {"linkread",  fun_linkread,  1, BI_BACK | BI_SAFE, "Print symbolic link target"},
+    {"linklist",  fun_linklist,  1, BI_BACK | BI_SAFE, "Print hard links (-r file [root]: whole tree)"},
+    {"unlink",    fun_unlink,    1, BI_BACK | BI_SAFE | BI_BATCH, "Unlink file"},
+    {"rename",    fun_rename,    2, BI_BACK | BI_SAFE | BI_BATCH, "Rename file"},
+    {"cpcat",     fun_cpcat,     0, BI_BACK | BI_SAFE, "Copy file"},
+    {"pipes",     fun_pipes,     2, BI_BACK,           "Create pipeline"},
+    {"hash",      fun_hash,      0, 0,                 "Print, fill or clear (-r) command paths"},
+    {"jobs",      fun_jobs,      0, BI_SHELL,          "List background jobs"},
+    {"wait",      fun_wait,      0, BI_SHELL,          "Wait for all or the given jobs"},
+    {"fg",        fun_fg,        0, BI_SHELL,          "Wait for the last or given job"},
+    {"parallel",  fun_parallel,  0, BI_BACK,           "Run command lines, -j at a time"},
+    {"linkindex", fun_linkindex, 1, BI_BACK | BI_SAFE, "Index hard links of a tree, print them or those of files"},
+    {"batch",     fun_batch,     0, BI_SHELL,          "Queue file system commands until end"},
+    {"end",       fun_end,       0, BI_SHELL,          "Run the queued file system commands"},
+    {"time",      fun_time,      1, 0,                 "Run a command and print its real, user and sys time"},
+    {"stats",     fun_stats,     0, 0,                 "Print or reset (-r) command counters and latencies"},
+    {"debug",     fun_debug,     0, 0,                 "Toggle debug mode: tracing, dump file.json writes the trace"},
+    {"capture",   fun_capture,   0, 0,                 "Run a command into memory for <@name; list, or drop (-r name)"}
+};
+
+//--------------------------------------------------------------------------------------
+// Counters: updated with relaxed atomics, builtins also count on other threads
+//--------------------------------------------------------------------------------------
+#define STAT_EXTERNAL B_COUNT
+#define STAT_BUCKETS 40     // bucket k: latencies below 2^k microseconds
+
+struct stats {
+    unsigned long commands[B_COUNT + 1];
+    unsigned long latency[B_COUNT + 1][STAT_BUCKETS];
+    unsigned long forks;
+    unsigned long spawns;
+    unsigned long copied;
+    unsigned long stages;
+    unsigned long reads;
+} stats;
+
+//--------------------------------------------------------------------------------------
+// Tracing: events in per-thread rings, written by their thread only, no locks
+//--------------------------------------------------------------------------------------
+#define TRACE_EVENTS 16384
+
+enum {T_READ, T_TOKENIZE, T_DISPATCH, T_REDIRECT, T_FORK, T_EXEC, T_WAIT, T_REAP};
+char *trace_names[] = {"read", "tokenize", "dispatch", "redirect", "fork", "exec", "wait", "reap"};
+
+struct trace_event {
+    uint64_t ts;
+    uint64_t dur;
+    int tid;
+    int cat;
+    char name[24];
+};
+struct trace_ring {
+    struct trace_ring *next;
+    int busy;
+    unsigned long head;
+    struct trace_event events[TRACE_EVENTS];
+};
+int tracing;
+struct trace_ring *trace_rings;
+pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+__thread struct trace_ring *trace_mine;
+__thread int trace_tid;
 
 int main (int argc, char *argv[]) {
     //-------------------------------------------------------------------------------
-    // Set SIGCHLD signal handler
+    // Options
+    //-------------------------------------------------------------------------------
+    int i;
+    char *socket_path = NULL, *script = NULL;
+    int zygote_mode = 0;
+    // options come before the script, everything after it is the script's
+    for (i = 1; i < argc && script == NULL; i++) {
+        if (strcmp(argv[i], "--cache") == 0 && i + 1 < argc) {
+            cache_dir = argv[++i];
+        } else if (strcmp(argv[i], "--serve") == 0 && i + 1 < argc) {
+            socket_path = argv[++i];
+        } else if (strcmp(argv[i], "--zygote") == 0) {
+            zygote_mode = 1;
+#ifdef TOKENIZE_CHECK
+        } else if (strcmp(argv[i], "--fuzz-tokenize") == 0 && i + 1 < argc) {
+            out = stdout;
+            err = stderr;
+            tokenize_fuzz(atol(argv[++i]));
+            exit(0);
+#endif
+        } else if (argv[i][0] != '-' || strcmp(argv[i], "-") == 0) {
+            script = argv[i];
+        } else {
+            fprintf(stderr, "usage: %s [--cache dir] [--serve socket] [--zygote] [script [args]]\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    // the zygote is forked while the shell is small and its signals are untouched
+    if (zygote_mode) {
+        zygote_start();
+    }
+    //-------------------------------------------------------------------------------
+    // Receive SIGCHLD through a descriptor, background jobs are reaped by the loop
     //-------------------------------------------------------------------------------
-    if (signal(SIGCHLD, handler) < 0) {
-        perror("signal");
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    if (sigprocmask(SIG_BLOCK, &mask, NULL) < 0) {
+        report("sigprocmask");
+    }
+    if ((sigfd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC)) < 0) {
+        int e = errno;
+        report("signalfd");
+        exit(e);
+    }
+    // builtin pipeline stages are threads: a closed pipe must not kill the shell
+    if (signal(SIGPIPE, SIG_IGN) == SIG_ERR) {
+        report("signal");
+    }
+    out = stdout;
+    err = stderr;
+    // the shell's directory, from here on known by its descriptor and path
+    if (set_cwd(".") < 0) {
+        int e = errno;
+        report("dir");
+        exit(e);
     }
+    // builtins' output waits for command boundaries, and the end of the shell; output
+    // shared with the errors goes out line by line to stay in order with them
+    atexit(out_flush);
+    if (out_eager(stdout)) {
+        setvbuf(stdout, NULL, _IOLBF, 0);
+    }
+    // many clients on one shell: nothing is read from the standard input
+    if (socket_path != NULL) {
+        exit(serve(socket_path));
+    }
+    // a script named on the command line leaves the standard input to its commands
+    int fd = 0;
+    if (script != NULL && strcmp(script, "-") != 0 && (fd = open(script, O_RDONLY | O_CLOEXEC)) < 0) {
+        report(script);
+        exit(127);
+    }
+    interactive = script == NULL && isatty(0);
+    reader_init(&input, fd);
+    char *line;
+    size_t len;
     //-------------------------------------------------------------------------------
     // 1. Non-interactive / script mode
     //-------------------------------------------------------------------------------
-    if (isatty(0) == 0) {
-        while (1) {
-            fflush(stdout);
-            // reading the line
-            char *line = NULL;
-            char c[1];
-            int i = 0, n;
-            while (1) {
-                n = read(0, c, 1);
-                if (n < 0) {
-                    int e = errno;
-                    perror("read");
-                    exit(e);
-                } else {
-                    // new character
-                    line = (char *) realloc(line, (i+1) * sizeof(char));
-                    line[i++] = c[0];
-                    // end of the line
-                    if (c[0] == '\n') {
-                        break;
-                    }
-                }
-            }
-            // check if we reached the end of the file
-            if (n == 0) {
+    if (!interactive) {
+        // with a cache, the script runs in its compiled form; a script file runs
+        // straight from its mapping
+        int done = cache_dir != NULL && cache_script(fd) == 0;
+        if (!done && fd != 0) {
+            done = script_run(fd) == 0;
+        }
+        // commands share the script's standard input; only a seekable one can be handed
+        // to them at the line they come from
+        if (!done && fd == 0) {
+            input_shared = lseek(0, 0, SEEK_CUR) < 0 ? -1 : 1;
+        }
+        while (!done) {
+            // reading the line, NULL means we reached the end of the file
+            uint64_t t = trace_start();
+            if ((line = read_line(&input, &len)) == NULL) {
                 break;
             }
+            trace_end(T_READ, "line", t);
             // a command was entered
-            if (strlen(line) > 1) {
+            if (len > 1) {
                 // get command data and execute it if it satifies conditions
-                if (tokenize(line)) {
+                t = trace_start();
+                int ok = tokenize(line, len);
+                trace_end(T_TOKENIZE, "line", t);
+                if (ok) {
                     eval();
                 }
+                arena_reset();
+            }
+            // collect the background jobs that have finished
+            if (job_running > 0) {
+                jobs_reap();
             }
         }
     //-------------------------------------------------------------------------------
@@ -107,975 +837,5369 @@ int main (int argc, char *argv[]) {
     //-------------------------------------------------------------------------------
     } else {
         while (1) {
-            // show prompt
+            // report finished jobs and show prompt
+            jobs_notify();
             printf("%s> ", name);
-            fflush(stdout);
-            // read the line
-            char *line = NULL;
-            char c[1];
-            int i = 0, n;
-            while (1) {
-                n = read(0, c, 1);
-                // error
-                if (n < 0) {
-                    int e = errno;
-                    perror("read");
-                    exit(e);
+            out_flush();
+            // read the line, NULL means CTRL+D was pressed on an empty line
+            uint64_t t = trace_start();
+            if ((line = read_line(&input, &len)) == NULL) {
+                printf("\n");
+                break;
+            }
+            trace_end(T_READ, "line", t);
+            // a command was entered
+            if (len > 1) {
+                // get command data and execute it if it satifies conditions
+                t = trace_start();
+                int ok = tokenize(line, len);
+                trace_end(T_TOKENIZE, "line", t);
+                if (ok) {
+                    eval();
+                }
+                arena_reset();
+            }
+            // collect the background jobs that have finished
+            if (job_running > 0) {
+                jobs_reap();
+            }
+        }
+    }
+    // end of shell
+    fs_flush();
+    tasks_wait();
+    exit(0);
+}
+//--------------------------------------------------------------------------------------
+// Buffered line reader
+//--------------------------------------------------------------------------------------
+void reader_init(struct reader *r, int fd) {
+    r->fd = fd;
+    r->size = READER_CHUNK;
+    // two spare bytes: a newline for the last unterminated line and a terminator
+    if ((r->buf = (char *) malloc(r->size + 2)) == NULL) {
+        int e = errno;
+        report("malloc");
+        exit(e);
+    }
+    r->start = 0;
+    r->end = 0;
+    r->eof = 0;
+}
+//-----------------------------------------------------------------------------------
+// Return the next line (with its newline) as a view into the reader's buffer
+//-----------------------------------------------------------------------------------
+char *read_line(struct reader *r, size_t *len) {
+    char *line, *nl;
+    ssize_t n;
+    while (1) {
+        // a whole line is already buffered
+        if ((nl = memchr(r->buf + r->start, '\n', r->end - r->start)) != NULL) {
+            line = r->buf + r->start;
+            *len = nl - line + 1;
+            r->start += *len;
+            return line;
+        }
+        // end of the file: hand out the last line even without a newline
+        if (r->eof) {
+            if (r->start == r->end) {
+                return NULL;
+            }
+            line = r->buf + r->start;
+            *len = r->end - r->start;
+            line[(*len)++] = '\n';
+            line[*len] = '\0';
+            r->start = r->end;
+            return line;
+        }
+        // move the unfinished line to the front of the buffer
+        if (r->start > 0) {
+            memmove(r->buf, r->buf + r->start, r->end - r->start);
+            r->end -= r->start;
+            r->start = 0;
+        }
+        // the unfinished line fills the whole buffer
+        if (r->end == r->size) {
+            r->size *= 2;
+            if ((r->buf = (char *) realloc(r->buf, r->size + 2)) == NULL) {
+                int e = errno;
+                report("realloc");
+                exit(e);
+            }
+        }
+        // read the next chunk, reaping the jobs that finish while we wait for it
+        if (job_running > 0 && r == &input) {
+            jobs_poll(r->fd);
+        }
+        if (r == &input) {
+            stat_add(&stats.reads, 1);
+        }
+        if ((n = read(r->fd, r->buf + r->end, r->size - r->end)) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            // a session's socket has nothing more for now
+            if (errno == EAGAIN) {
+                return NULL;
+            }
+            int e = errno;
+            report("read");
+            if (r == &input) {
+                exit(e);
+            }
+            // other readers end with the error
+            r->eof = 1;
+            continue;
+        } else if (n == 0) {
+            r->eof = 1;
+        }
+        r->end += n;
+        r->buf[r->end] = '\0';
+    }
+}
+//-----------------------------------------------------------------------------------
+// Let a command read the standard input the script comes from: what was read ahead of
+// it goes back, and the script goes on from wherever the command stops; -1 when the
+// input can't go back
+//-----------------------------------------------------------------------------------
+int input_claim(int fd) {
+    if (fd != 0 || input_shared == 0) {
+        return 0;
+    }
+    if (input_shared < 0 || lseek(0, -(off_t) (input.end - input.start), SEEK_CUR) < 0) {
+        return -1;
+    }
+    input.start = 0;
+    input.end = 0;
+    input.eof = 0;
+    return 0;
+}
+//--------------------------------------------------------------------------------------
+// Bump allocation from the per-command arena
+//--------------------------------------------------------------------------------------
+void *arena_alloc(size_t size) {
+    size = (size + ARENA_ALIGN - 1) & ~((size_t) ARENA_ALIGN - 1);
+    // the current block is full, so chain a new one in front of it
+    if (arena == NULL || arena->size - arena->used < size) {
+        size_t block = size > ARENA_BLOCK ? size : ARENA_BLOCK;
+        struct arena_block *b = (struct arena_block *) malloc(sizeof(struct arena_block) + block);
+        if (b == NULL) {
+            int e = errno;
+            report("malloc");
+            exit(e);
+        }
+        b->next = arena;
+        b->size = block;
+        b->used = 0;
+        arena = b;
+    }
+    void *p = arena->data + arena->used;
+    arena->used += size;
+    return p;
+}
+//-----------------------------------------------------------------------------------
+// Remember how far the arena is filled, to give back what a loop allocates
+//-----------------------------------------------------------------------------------
+struct arena_block *arena_mark(size_t *used) {
+    *used = arena != NULL ? arena->used : 0;
+    return arena;
+}
+//-----------------------------------------------------------------------------------
+// Free everything allocated since arena_mark
+//-----------------------------------------------------------------------------------
+void arena_release(struct arena_block *block, size_t used) {
+    struct arena_block *next;
+    while (arena != block) {
+        next = arena->next;
+        free(arena);
+        arena = next;
+    }
+    if (arena != NULL) {
+        arena->used = used;
+    }
+}
+//-----------------------------------------------------------------------------------
+// Release everything the last command allocated
+//-----------------------------------------------------------------------------------
+void arena_reset() {
+    if (arena == NULL) {
+        return;
+    }
+    // a command outgrew the block: replace the chain with one block that fits it
+    if (arena->next != NULL) {
+        size_t total = 0;
+        struct arena_block *b = arena, *next;
+        while (b != NULL) {
+            next = b->next;
+            total += b->size;
+            free(b);
+            b = next;
+        }
+        if ((arena = (struct arena_block *) malloc(sizeof(struct arena_block) + total)) == NULL) {
+            int e = errno;
+            report("malloc");
+            exit(e);
+        }
+        arena->next = NULL;
+        arena->size = total;
+    // the block grown for a long line goes back to the default size once a command
+    // fits in that again, no line pins its size for the rest of the shell
+    } else if (arena->size > ARENA_BLOCK && arena->used <= ARENA_BLOCK) {
+        struct arena_block *b = (struct arena_block *) realloc(arena, sizeof(struct arena_block) + ARENA_BLOCK);
+        if (b != NULL) {
+            arena = b;
+            arena->size = ARENA_BLOCK;
+        }
+    }
+    arena->used = 0;
+}
+//-----------------------------------------------------------------------------------
+// Give the arena back when a thread ends
+//-----------------------------------------------------------------------------------
+void arena_free() {
+    struct arena_block *next;
+    while (arena != NULL) {
+        next = arena->next;
+        free(arena);
+        arena = next;
+    }
+}
+//--------------------------------------------------------------------------------------
+// Line reading and detection of symbols
+//--------------------------------------------------------------------------------------
+int tokenize(char *line, size_t len) {
+#ifdef TOKENIZE_CHECK
+    // check builds lex every line a second time, byte by byte, and compare
+    char *copy = (char *) arena_alloc(len + 1);
+    memcpy(copy, line, len);
+    copy[len] = '\0';
+    int ok = lex(line, len);
+    tokenize_check(copy, len, ok);
+    return ok;
+#else
+    return lex(line, len);
+#endif
+}
+//-----------------------------------------------------------------------------------
+// Split the line into symbols in place: whitespace separates them, 'single' and
+// "double" quotes and backslashes join and escape bytes, adjacent parts concatenate
+//-----------------------------------------------------------------------------------
+int lex(char *line, size_t len) {
+    size_t i = 0, j, k, w;
+    // one bit per byte that is whitespace, a quote or a backslash; plain runs between
+    // them are skipped whole
+    uint64_t *special = (uint64_t *) arena_alloc((len / 64 + 1) * sizeof(uint64_t));
+    classify(line, len, special);
+    // a line of n characters holds at most n/2+1 symbols, plus the terminating NULL
+    tokens = (char **) arena_alloc((len/2 + 2) * sizeof(char *));
+    token_count = 0;
+    literal = NULL;
+    // blank lines and comments are not commands
+    while (i < len && line[i] != '\n' && is_space(line[i])) {
+        i++;
+    }
+    if (i == len || line[i] == '\n' || line[i] == '#') {
+        return 0;
+    }
+    while (i < len && line[i] != '\n') {
+        // the symbol is unquoted in place: w is where its next byte goes
+        tokens[token_count++] = line + (w = i);
+        // past the whitespace, a special first byte is a quote or a backslash: whatever
+        // the symbol looks like, it is an argument
+        if ((special[i / 64] >> (i % 64)) & 1) {
+            if (literal == NULL) {
+                literal = (char *) arena_alloc(len/2 + 2);
+                memset(literal, 0, len/2 + 2);
+            }
+            literal[token_count-1] = 1;
+        }
+        while (1) {
+            j = next_special(special, i, len);
+            if (w != i) {
+                memmove(line + w, line + i, j - i);
+            }
+            w += j - i;
+            i = j;
+            if (i == len || is_space(line[i])) {
+                break;
+            }
+            // escaped byte, or a backslash that ends the line
+            if (line[i] == '\\') {
+                if (i + 1 < len && line[i+1] != '\n') {
+                    line[w++] = line[i+1];
+                    i += 2;
                 } else {
-                    // new character
-                    line = (char *) realloc(line, (i+1) * sizeof(char));
-                    line[i++] = c[0];
-                    // end of string
-                    if (c[0] == '\n') {
-                        break;
+                    line[w++] = line[i++];
+                }
+                continue;
+            }
+            // single quotes: everything up to the next one
+            // double quotes: the same, but \" and \\ are escapes
+            char quote = line[i];
+            k = i + 1;
+            while (1) {
+                j = next_special(special, k, len);
+                if (j == len || line[j] == '\n') {
+                    fprintf(err, "syntax error: unterminated %s quote\n", quote == '"' ? "double" : "single");
+                    token_count = 0;
+                    return 0;
+                }
+                memmove(line + w, line + k, j - k);
+                w += j - k;
+                if (line[j] == quote) {
+                    break;
+                }
+                if (quote == '"' && line[j] == '\\' && j + 1 < len && (line[j+1] == '"' || line[j+1] == '\\')) {
+                    j++;
+                }
+                line[w++] = line[j];
+                k = j + 1;
+            }
+            i = j + 1;
+        }
+        // end the symbol, remembering whether it also ended the line
+        char c = i < len ? line[i] : '\n';
+        line[w] = '\0';
+        i++;
+        if (c == '\n') {
+            break;
+        }
+        while (i < len && line[i] != '\n' && is_space(line[i])) {
+            i++;
+        }
+    }
+    tokens[token_count] = NULL;
+    return 1;
+}
+//-----------------------------------------------------------------------------------
+// Whitespace as isspace() knows it in the C locale
+//-----------------------------------------------------------------------------------
+int is_space(char c) {
+    return c == ' ' || (unsigned char) (c - '\t') <= '\r' - '\t';
+}
+//-----------------------------------------------------------------------------------
+// Position of the first special byte at or after i, or len
+//-----------------------------------------------------------------------------------
+size_t next_special(uint64_t *special, size_t i, size_t len) {
+    size_t word = i / 64;
+    if (i >= len) {
+        return len;
+    }
+    uint64_t bits = special[word] & (~0ULL << (i % 64));
+    while (bits == 0) {
+        if (++word * 64 >= len) {
+            return len;
+        }
+        bits = special[word];
+    }
+    i = word * 64 + __builtin_ctzll(bits);
+    return i < len ? i : len;
+}
+//-----------------------------------------------------------------------------------
+// Mark the special bytes of the line, 32 or 16 at a time where the CPU can
+//-----------------------------------------------------------------------------------
+void classify(char *line, size_t len, uint64_t *special) {
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("avx2")) {
+        classify_avx2(line, len, special);
+    } else {
+        classify_sse2(line, len, special);
+    }
+#else
+    classify_scalar(line, len, special);
+#endif
+}
+void classify_scalar(char *line, size_t len, uint64_t *special) {
+    memset(special, 0, (len / 64 + 1) * sizeof(uint64_t));
+    classify_tail(line, 0, len, special);
+}
+void classify_tail(char *line, size_t i, size_t len, uint64_t *special) {
+    for (; i < len; i++) {
+        if (is_space(line[i]) || line[i] == '"' || line[i] == '\'' || line[i] == '\\') {
+            special[i / 64] |= 1ULL << (i % 64);
+        }
+    }
+}
+#if defined(__x86_64__)
+void classify_sse2(char *line, size_t len, uint64_t *special) {
+    size_t i;
+    memset(special, 0, (len / 64 + 1) * sizeof(uint64_t));
+    for (i = 0; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((__m128i *) (line + i));
+        // whitespace is \t..\r or a space
+        __m128i t = _mm_sub_epi8(v, _mm_set1_epi8('\t'));
+        __m128i m = _mm_cmpeq_epi8(_mm_min_epu8(t, _mm_set1_epi8('\r' - '\t')), t);
+        m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8(' ')));
+        m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('"')));
+        m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('\'')));
+        m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('\\')));
+        special[i / 64] |= (uint64_t) (unsigned) _mm_movemask_epi8(m) << (i % 64);
+    }
+    classify_tail(line, i, len, special);
+}
+__attribute__((target("avx2")))
+void classify_avx2(char *line, size_t len, uint64_t *special) {
+    size_t i;
+    memset(special, 0, (len / 64 + 1) * sizeof(uint64_t));
+    for (i = 0; i + 32 <= len; i += 32) {
+        __m256i v = _mm256_loadu_si256((__m256i *) (line + i));
+        __m256i t = _mm256_sub_epi8(v, _mm256_set1_epi8('\t'));
+        __m256i m = _mm256_cmpeq_epi8(_mm256_min_epu8(t, _mm256_set1_epi8('\r' - '\t')), t);
+        m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')));
+        m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('"')));
+        m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\'')));
+        m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\\')));
+        special[i / 64] |= (uint64_t) (unsigned) _mm256_movemask_epi8(m) << (i % 64);
+    }
+    classify_tail(line, i, len, special);
+}
+#endif
+#ifdef TOKENIZE_CHECK
+//-----------------------------------------------------------------------------------
+// The lexer one byte at a time, as the reference the fast one is checked against
+//-----------------------------------------------------------------------------------
+int tokenize_scalar(char *line, size_t len) {
+    char *p = line, *end = line + len, *w, quote;
+    tokens = (char **) arena_alloc((len/2 + 2) * sizeof(char *));
+    token_count = 0;
+    while (p < end && *p != '\n' && isspace((unsigned char) *p)) {
+        p++;
+    }
+    if (p == end || *p == '\n' || *p == '#') {
+        return 0;
+    }
+    while (p < end && *p != '\n') {
+        tokens[token_count++] = w = p;
+        while (p < end && !isspace((unsigned char) *p)) {
+            if (*p == '\\') {
+                *w++ = p + 1 < end && p[1] != '\n' ? *++p : '\\';
+                p++;
+            } else if (*p == '\'' || *p == '"') {
+                quote = *p++;
+                while (p < end && *p != quote && *p != '\n') {
+                    if (quote == '"' && *p == '\\' && p + 1 < end && (p[1] == '"' || p[1] == '\\')) {
+                        p++;
                     }
+                    *w++ = *p++;
+                }
+                if (p == end || *p == '\n') {
+                    return 0;
+                }
+                p++;
+            } else {
+                *w++ = *p++;
+            }
+        }
+        char c = p < end ? *p : '\n';
+        *w = '\0';
+        p++;
+        if (c == '\n') {
+            break;
+        }
+        while (p < end && *p != '\n' && isspace((unsigned char) *p)) {
+            p++;
+        }
+    }
+    tokens[token_count] = NULL;
+    return 1;
+}
+//-----------------------------------------------------------------------------------
+// Lex the copy of a line byte by byte and abort unless the symbols are the same
+//-----------------------------------------------------------------------------------
+void tokenize_check(char *copy, size_t len, int ok) {
+    char **fast = tokens;
+    int i, count = token_count;
+    int same = tokenize_scalar(copy, len) == ok && (!ok || token_count == count);
+    for (i = 0; same && ok && i < count; i++) {
+        same = strcmp(fast[i], tokens[i]) == 0;
+    }
+    if (!same) {
+        fprintf(stderr, "tokenize: lexers disagree on a line of %zu bytes, at symbol %d\n", len, i);
+        abort();
+    }
+    tokens = fast;
+    token_count = count;
+}
+//-----------------------------------------------------------------------------------
+// Check random lines made of the bytes the lexers care about: --fuzz-tokenize N
+//-----------------------------------------------------------------------------------
+void tokenize_fuzz(long lines) {
+    char alphabet[] = "ab  \t\"\"''\\\\#<>&\r\v\f\n";
+    char line[4096];
+    long n;
+    FILE *saved = err;
+    // unterminated quotes are reported, quietly
+    if ((err = fopen("/dev/null", "w")) == NULL) {
+        report("fopen");
+        err = saved;
+        return;
+    }
+    srand(getpid());
+    for (n = 0; n < lines; n++) {
+        // short lines, and now and then one past the 64-byte blocks of the classifier
+        size_t i, len = rand() % (n % 100 == 0 ? sizeof(line) - 2 : 150);
+        for (i = 0; i < len; i++) {
+            line[i] = rand() % 8 == 0 ? (char) (rand() % 256) : alphabet[rand() % (sizeof(alphabet) - 1)];
+        }
+        line[len++] = '\n';
+        line[len] = '\0';
+        tokenize(line, len);
+        arena_reset();
+    }
+    fclose(err);
+    err = saved;
+    fprintf(out, "%ld lines, both lexers agree\n", lines);
+}
+#endif
+//--------------------------------------------------------------------------------------
+// Command execution
+//--------------------------------------------------------------------------------------
+void eval() {
+    int i = parse();
+    if (i >= 0) {
+        execute(find_builtin(tokens[0]), i);
+    }
+}
+//-----------------------------------------------------------------------------------
+// Split the trailing & and the redirections, wherever they are, off the tokens;
+// return the last argument
+//-----------------------------------------------------------------------------------
+int parse() {
+    int i, n = 0, k;
+    opt = (int *) arena_alloc(3 * sizeof(int));
+    memset(opt, 0, 3 * sizeof(int));
+    redirects = NULL;
+    redirect_count = 0;
+    // process in background
+    if (strcmp(tokens[token_count-1], "&") == 0) {
+        opt[2] = 1;
+        token_count--;
+    }
+    for (i = 0; i < token_count; i++) {
+        char c = tokens[i][0];
+        if ((c != '<' && c != '>' && (c < '0' || c > '2')) || (literal != NULL && literal[i])) {
+            tokens[n++] = tokens[i];
+            continue;
+        }
+        if (redirects == NULL) {
+            redirects = (struct redirect *) arena_alloc(token_count * sizeof(struct redirect));
+        }
+        struct redirect *r = &redirects[redirect_count];
+        if ((k = redirect_scan(tokens[i], r)) == 0) {
+            tokens[n++] = tokens[i];
+            continue;
+        }
+        // the file is the next symbol: > file
+        if (k == 2 && i + 1 == token_count) {
+            fprintf(err, "syntax error: %s without a file\n", tokens[i]);
+            k = -1;
+        } else if (k == 2) {
+            r->path = tokens[++i];
+        }
+        if (k < 0) {
+            status = EXIT_FAILURE;
+            return -1;
+        }
+        // redirection of input, of output or errors
+        opt[r->fd == 0 ? 0 : 1] = 1;
+        redirect_count++;
+    }
+    tokens[n] = NULL;
+    token_count = n;
+    return n - 1;
+}
+//-----------------------------------------------------------------------------------
+// Read a redirection: [n]<file, [n]>file, [n]>>file, [n]<>file or [n]>&m, n and m
+// being 0, 1 or 2; 1 when it is whole, 2 when the file is the next symbol, 0 for an
+// argument and -1 after a syntax error
+//-----------------------------------------------------------------------------------
+int redirect_scan(char *s, struct redirect *r) {
+    char *p = s;
+    r->fd = -1;
+    r->dup = -1;
+    // only the three standard descriptors are redirected, 5>x is an argument
+    if (*p >= '0' && *p <= '2') {
+        r->fd = *p++ - '0';
+    }
+    if (p[0] == '<' && p[1] == '>') {
+        r->flags = O_RDWR | O_CREAT;
+        p += 2;
+    } else if (p[0] == '<') {
+        r->flags = O_RDONLY;
+        p++;
+    } else if (p[0] == '>' && p[1] == '>') {
+        r->flags = O_WRONLY | O_CREAT | O_APPEND;
+        p += 2;
+    } else if (p[0] == '>') {
+        r->flags = O_WRONLY | O_CREAT | O_TRUNC;
+        p++;
+    } else {
+        return 0;
+    }
+    if (r->fd < 0) {
+        r->fd = s[0] == '<' ? 0 : 1;
+    }
+    // a copy of another of the three
+    if (*p == '&') {
+        if (p[1] < '0' || p[1] > '2' || p[2] != '\0' || (r->flags & (O_APPEND | O_RDWR))) {
+            fprintf(err, "syntax error: %s\n", s);
+            return -1;
+        }
+        r->dup = p[1] - '0';
+        r->path = NULL;
+        return 1;
+    }
+    r->path = p;
+    return *p != '\0' ? 1 : 2;
+}
+//-----------------------------------------------------------------------------------
+// Open the redirections of a builtin: fds gets what its standard input, output and
+// errors end up as, opened the descriptors that were opened; their count, or -1
+//-----------------------------------------------------------------------------------
+int redirect_open(int *fds, int *opened) {
+    int j, n = 0, fd;
+    fds[0] = in;
+    fds[1] = fileno(out);
+    fds[2] = fileno(err);
+    for (j = 0; j < redirect_count; j++) {
+        struct redirect *r = &redirects[j];
+        if (r->path == NULL) {
+            fd = fds[r->dup];
+        // <@name reads what capture kept under the name
+        } else if (r->flags == O_RDONLY && r->path[0] == '@') {
+            fd = capture_open(&r->path[1]);
+        } else if ((fd = openat(cwdfd, r->path, r->flags | O_CLOEXEC, 0666)) < 0) {
+            report(r->path);
+        }
+        if (fd < 0) {
+            while (n > 0) {
+                close(opened[--n]);
+            }
+            return -1;
+        }
+        if (r->path != NULL) {
+            opened[n++] = fd;
+        }
+        fds[r->fd] = fd;
+    }
+    return n;
+}
+//-----------------------------------------------------------------------------------
+// A stream on a redirected descriptor: it takes over one that was opened for it,
+// others it copies
+//-----------------------------------------------------------------------------------
+FILE *redirect_stream(int fd, int *opened, int n) {
+    FILE *f;
+    int j = 0;
+    while (j < n && opened[j] != fd) {
+        j++;
+    }
+    if (j == n && (fd = fcntl(fd, F_DUPFD_CLOEXEC, 3)) < 0) {
+        report("fcntl");
+        return NULL;
+    }
+    if ((f = fdopen(fd, "w")) == NULL) {
+        report("fdopen");
+        close(fd);
+        return NULL;
+    }
+    if (j < n) {
+        opened[j] = -1;
+    }
+    return f;
+}
+//-----------------------------------------------------------------------------------
+// Run builtin b (or an external command when b < 0) on tokens[0..i], as parsed
+//-----------------------------------------------------------------------------------
+void execute(int b, int i) {
+    // sessions share the process: the job table and the batch queue are the shell's
+    if (session != NULL) {
+        if (b >= 0 && (builtins[b].flags & BI_SHELL)) {
+            fprintf(err, "%s: not available in a session\n", builtins[b].name);
+            status = EXIT_FAILURE;
+            return;
+        }
+        opt[2] = 0;
+    }
+    // inside batch ... end, file system builtins are only queued
+    if (batching) {
+        if (b >= 0 && (builtins[b].flags & BI_BATCH) && i >= builtins[b].args && i <= 2
+                && opt[0] == 0 && opt[1] == 0 && opt[2] == 0) {
+            stat_add(&stats.commands[b], 1);
+            fs_queue(b, i);
+            return;
+        }
+        // anything else may depend on them
+        if (b != B_END) {
+            fs_flush();
+        }
+    }
+    // background commands are timed by their job
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    char *com = b >= 0 ? builtins[b].name : tokens[0];
+    uint64_t t = trace_start();
+    //-------------------------------------------------------------------------------
+    // INTERNAL COMMANDS
+    //-------------------------------------------------------------------------------
+    if (b >= 0) {
+        // the descriptors are everyone's: a redirected builtin gets streams of its own
+        // and the shell's are put back afterwards, nothing is touched without redirections
+        FILE *saved_out = out, *saved_err = err, *own_out = NULL, *own_err = NULL;
+        int j, n = 0, saved_in = in, fds[3], *opened = NULL;
+        int eager = output != NULL && output->stream == out ? output->eager : -1;
+        if (redirect_count > 0) {
+            uint64_t tr = trace_start();
+            opened = (int *) arena_alloc(redirect_count * sizeof(int));
+            if ((n = redirect_open(fds, opened)) < 0) {
+                status = EXIT_FAILURE;
+                trace_end(T_DISPATCH, com, t);
+                return;
+            }
+            in = fds[0];
+            // where the descriptors are the shell's, so are the streams
+            if (fds[1] == fileno(saved_err)) {
+                out_switch(saved_err, -1);
+            } else if (fds[1] != fileno(saved_out) && (own_out = redirect_stream(fds[1], opened, n)) != NULL) {
+                // the errors written as they happen keep their place in a shared file
+                out_switch(own_out, fds[2] == fds[1]);
+            }
+            if (fds[2] == fileno(out)) {
+                err = out;
+            } else if (fds[2] == fileno(saved_out)) {
+                err = saved_out;
+            } else if (fds[2] != fileno(saved_err) && (own_err = redirect_stream(fds[2], opened, n)) != NULL) {
+                setvbuf(own_err, NULL, _IONBF, 0);
+                err = own_err;
+            }
+            trace_end(T_REDIRECT, com, tr);
+        }
+        // builtins that print through out itself come after the buffered output
+        if ((builtins[b].flags & BI_OUT) == 0 && output != NULL && output->used > 0) {
+            out_flush();
+        }
+        if (i < builtins[b].args) {
+            fprintf(err, "%s: missing operand\n", builtins[b].name);
+            status = EXIT_FAILURE;
+        // foreground, or a command that ignores &
+        } else if (opt[2] == 0 || (builtins[b].flags & BI_BACK) == 0) {
+            status = builtins[b].fun(i);
+        // background, without copying the whole shell when the builtin allows it
+        } else if (builtins[b].flags & BI_SAFE) {
+            struct job *job = job_add(0, i);
+            if (task_submit(b, i, job != NULL ? job->id : 0) < 0 && job != NULL) {
+                job_finish(job, EXIT_FAILURE);
+            }
+        } else {
+            uint64_t tf = trace_start();
+            int pid = fork();
+            if (pid < 0) {
+                report("fork");
+            } else if (pid == 0) {
+                exit(builtins[b].fun(i));
+            } else {
+                trace_end(T_FORK, com, tf);
+                stat_add(&stats.forks, 1);
+                job_add(pid, i);
+            }
+        }
+        // put the shell's streams back; closing a stream closes its descriptor too
+        if (redirect_count > 0) {
+            in = saved_in;
+            if (own_err != NULL) {
+                fclose(own_err);
+            }
+            err = saved_err;
+            if (out != saved_out) {
+                if (own_out != NULL) {
+                    out_close();
+                }
+                out_switch(saved_out, eager);
+            }
+            for (j = 0; j < n; j++) {
+                if (opened[j] >= 0 && close(opened[j]) < 0) {
+                    report("close");
+                }
+            }
+        }
+    //-------------------------------------------------------------------------------
+    // EXTERNAL COMMANDS
+    //-------------------------------------------------------------------------------
+    } else {
+        // the child opens the files itself, on its way to exec
+        if (opt[2] == 0) {
+            fun_exec_front(i, redirects, redirect_count);
+        // background
+        } else {
+            fun_exec_back(i, redirects, redirect_count);
+        }
+    }
+    if (opt[2] == 0 || (b >= 0 && (builtins[b].flags & BI_BACK) == 0)) {
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        stat_command(b, &start, &end);
+    }
+    trace_end(T_DISPATCH, com, t);
+}
+//-----------------------------------------------------------------------------------
+// Look up a builtin: the length and a distinguishing byte pick the only candidate
+//-----------------------------------------------------------------------------------
+int find_builtin(char *com) {
+    int b = -1;
+    switch (strlen(com)) {
+    case 2:
+        if (com[0] == 'f') {
+            b = B_FG;
+        }
+        break;
+    case 3:
+        switch (com[0]) {
+        case 'p': b = B_PID; break;
+        case 'd': b = B_DIR; break;
+        case 'e': b = B_END; break;
+        }
+        break;
+    case 4:
+        switch (com[0]) {
+        case 'n': b = B_NAME; break;
+        case 'h': b = com[1] == 'e' ? B_HELP : B_HASH; break;
+        case 'e': b = com[1] == 'x' ? B_EXIT : B_ECHO; break;
+        case 'p': b = B_PPID; break;
+        case 'j': b = B_JOBS; break;
+        case 'w': b = B_WAIT; break;
+        case 't': b = B_TIME; break;
+        }
+        break;
+    case 5:
+        switch (com[0]) {
+        case 'p': b = com[1] == 'r' ? B_PRINT : B_PIPES; break;
+        case 'c': b = B_CPCAT; break;
+        case 'b': b = B_BATCH; break;
+        case 'd': b = B_DEBUG; break;
+        case 's': b = B_STATS; break;
+        }
+        break;
+    case 6:
+        switch (com[0]) {
+        case 's': b = B_STATUS; break;
+        case 'u': b = B_UNLINK; break;
+        case 'r': b = B_RENAME; break;
+        }
+        break;
+    case 7:
+        if (com[0] == 'd') {
+            b = com[3] == 'l' ? B_DIRLIST : B_DIRMAKE;
+        } else if (com[0] == 'c') {
+            b = B_CAPTURE;
+        }
+        break;
+    case 8:
+        switch (com[0]) {
+        case 'd': b = B_DIRWHERE; break;
+        case 'p': b = B_PARALLEL; break;
+        case 'l':
+            switch (com[4]) {
+            case 'h': b = B_LINKHARD; break;
+            case 's': b = B_LINKSOFT; break;
+            case 'r': b = B_LINKREAD; break;
+            case 'l': b = B_LINKLIST; break;
+            }
+            break;
+        }
+        break;
+    case 9:
+        switch (com[0]) {
+        case 'd': b = B_DIRREMOVE; break;
+        case 'l': b = B_LINKINDEX; break;
+        }
+        break;
+    }
+    // the candidate still has to match in full
+    if (b >= 0 && strcmp(com, builtins[b].name) != 0) {
+        return -1;
+    }
+    return b;
+}
+//-----------------------------------------------------------------------------------
+// Move to the directory at path, relative to the current one: its descriptor and its
+// path, asked of the kernel once here, replace the thread's
+//-----------------------------------------------------------------------------------
+int set_cwd(char *path) {
+    char link[32], buf[PATH_MAX], *copy;
+    struct stat st;
+    int fd = openat(cwdfd, path, O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    snprintf(link, sizeof(link), "/proc/self/fd/%d", fd);
+    ssize_t n = readlink(link, buf, sizeof(buf) - 1);
+    if (n >= 0) {
+        buf[n] = '\0';
+        // a directory that was removed keeps its last path, with a mark the kernel adds
+        if (n > 10 && strcmp(buf + n - 10, " (deleted)") == 0 && fstat(fd, &st) == 0 && st.st_nlink == 0) {
+            buf[n - 10] = '\0';
+        }
+    // without /proc the path is made of the current one and the way there
+    } else if (cwd_join(cwd, path, buf) == 0) {
+        n = 0;
+    }
+    if (n < 0 || (copy = strdup(buf)) == NULL) {
+        int e = errno;
+        close(fd);
+        errno = e;
+        return -1;
+    }
+    if (cwdfd != AT_FDCWD) {
+        close(cwdfd);
+    }
+    free(cwd);
+    cwdfd = fd;
+    cwd = copy;
+    return 0;
+}
+//-----------------------------------------------------------------------------------
+// Path of path as seen from directory base, or from the process's own when base is
+// NULL; . and .. are taken as written, like cd does without -P
+//-----------------------------------------------------------------------------------
+int cwd_join(char *base, char *path, char *buf) {
+    size_t len, used = 0;
+    char *p = path;
+    if (path[0] != '/') {
+        if (base == NULL && getcwd(buf, PATH_MAX) == NULL) {
+            return -1;
+        }
+        if (base != NULL && snprintf(buf, PATH_MAX, "%s", base) >= PATH_MAX) {
+            errno = ENAMETOOLONG;
+            return -1;
+        }
+        used = strlen(buf);
+        if (used == 1) {
+            used = 0;
+        }
+    }
+    while (*p != '\0') {
+        while (*p == '/') {
+            p++;
+        }
+        for (len = 0; p[len] != '\0' && p[len] != '/'; len++) { }
+        if (len == 2 && p[0] == '.' && p[1] == '.') {
+            while (used > 0 && buf[--used] != '/') { }
+        } else if (len > 0 && !(len == 1 && p[0] == '.')) {
+            if (used + len + 2 > PATH_MAX) {
+                errno = ENAMETOOLONG;
+                return -1;
+            }
+            buf[used++] = '/';
+            memcpy(buf + used, p, len);
+            used += len;
+        }
+        p += len;
+    }
+    if (used == 0) {
+        buf[used++] = '/';
+    }
+    buf[used] = '\0';
+    return 0;
+}
+//-----------------------------------------------------------------------------------
+// Print or change shell name
+//-----------------------------------------------------------------------------------
+int fun_name(int args) {
+    if (args == 1) {
+        // the token lives in the input buffer, so keep a copy of it
+        free(name_copy);
+        if ((name_copy = strdup(tokens[1])) == NULL) {
+            report("strdup");
+            name = "mysh";
+            return 1;
+        }
+        name = name_copy;
+    } else {
+        fprintf(out, "%s\n", name);
+    }
+    return 0;
+}
+//-----------------------------------------------------------------------------------
+// Print help
+//-----------------------------------------------------------------------------------
+int fun_help(int args) {
+    struct writer *w = out_writer();
+    char line[256];
+    int i, len;
+    if (w == NULL) {
+        return 1;
+    }
+    for (i = 0; i < B_COUNT; i++) {
+        len = snprintf(line, sizeof(line), "%9s - %s\n", builtins[i].name, builtins[i].description);
+        writer_put(w, line, len < (int) sizeof(line) ? (size_t) len : sizeof(line) - 1);
+    }
+    return out_end(w);
+}
+//-----------------------------------------------------------------------------------
+// Print the status of the last foreground command or waited job
+//-----------------------------------------------------------------------------------
+int fun_status(int args) {
+    fprintf(out, "%d\n", status);
+    return status;
+}
+//-----------------------------------------------------------------------------------
+// Exit
+//-----------------------------------------------------------------------------------
+int fun_exit(int args) {
+    int stat = 0;
+    if (args == 1) {
+        stat = atoi(tokens[1]);
+    }
+    // a session ends, the shell serving it goes on
+    if (session != NULL) {
+        session->closing = 1;
+        return stat;
+    }
+    fs_flush();
+    tasks_wait();
+    exit(stat);
+}
+//-----------------------------------------------------------------------------------
+// Print without new line
+//-----------------------------------------------------------------------------------
+int fun_print(int args) {
+    return print_args(args, "");
+}
+//-----------------------------------------------------------------------------------
+// Print with new line
+//-----------------------------------------------------------------------------------
+int fun_echo(int args) {
+    return print_args(args, "\n");
+}
+//-----------------------------------------------------------------------------------
+// The arguments separated by spaces, then end, as one line of the output writer
+//-----------------------------------------------------------------------------------
+int print_args(int args, char *end) {
+    struct writer *w = out_writer();
+    // the parts start at 1, the writer may use the first
+    struct iovec *iov = (struct iovec *) arena_alloc((2 * args + 2) * sizeof(struct iovec));
+    int i, n = 0;
+    if (w == NULL) {
+        return 1;
+    }
+    for (i = 1; i <= args; i++) {
+        iov[++n].iov_base = tokens[i];
+        iov[n].iov_len = strlen(tokens[i]);
+        if (i < args) {
+            iov[++n].iov_base = " ";
+            iov[n].iov_len = 1;
+        }
+    }
+    iov[++n].iov_base = end;
+    iov[n].iov_len = strlen(end);
+    writer_putv(w, iov, n);
+    return out_end(w);
+}
+//-----------------------------------------------------------------------------------
+// Print PID
+//-----------------------------------------------------------------------------------
+int fun_pid(int args) {
+    fprintf(out, "%d\n", getpid());
+    return 0;
+}
+//-----------------------------------------------------------------------------------
+// Print PPID
+//-----------------------------------------------------------------------------------
+int fun_ppid(int args) {
+    fprintf(out, "%d\n", getppid());
+    return 0;
+}
+//-----------------------------------------------------------------------------------
+// Change directory
+//-----------------------------------------------------------------------------------
+int fun_dir(int args) {
+    char *path = "/";
+    if (args == 1) {
+        path = tokens[1];
+    }
+    if (set_cwd(path) < 0) {
+        report("dir");
+        return 1;
+    }
+    return 0;
+}
+//-----------------------------------------------------------------------------------
+// Print current directory
+//-----------------------------------------------------------------------------------
+int fun_dirwhere(int args) {
+    fprintf(out, "%s\n", cwd);
+    return 0;
+}
+//-----------------------------------------------------------------------------------
+// Create a new directory
+//-----------------------------------------------------------------------------------
+int fun_dirmake(int args) {
+    if (mkdirat(cwdfd, tokens[1], S_IRWXU) < 0) {
+        report("dirmake");
+        return 1;
+    }
+    return 0;
+}
+//-----------------------------------------------------------------------------------
+// Delete a directory
+//-----------------------------------------------------------------------------------
+int fun_dirremove(int args) {
+    if (unlinkat(cwdfd, tokens[1], AT_REMOVEDIR) < 0) {
+        report("dirremove");
+        return 1;
+    }
+    return 0;
+}
+//-----------------------------------------------------------------------------------
+// Print files in a directory
+//-----------------------------------------------------------------------------------
+int fun_dirlist(int args) {
+    int i, sorted = 0, longform = 0;
+    char *path = ".";
+    // parse the options
+    for (i = 1; i <= args; i++) {
+        if (tokens[i][0] == '-' && tokens[i][1] != '\0') {
+            char *o;
+            for (o = &tokens[i][1]; *o != '\0'; o++) {
+                if (*o == 's') {
+                    sorted = 1;
+                } else if (*o == 'l') {
+                    longform = 1;
+                } else {
+                    fprintf(err, "usage: dirlist [-ls] [directory]\n");
+                    return 1;
+                }
+            }
+        } else {
+            path = tokens[i];
+        }
+    }
+    int fd = openat(cwdfd, path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        report("opendir");
+        return 1;
+    }
+    char *buf = (char *) malloc(DIRENT_BUF);
+    struct writer *w = out_writer();
+    if (buf == NULL || w == NULL) {
+        if (buf == NULL) {
+            report("malloc");
+        }
+        free(buf);
+        close(fd);
+        return 1;
+    }
+    // the names are kept only when they have to be sorted or stat'ed
+    int keep = sorted || longform;
+    struct dir_entry *entries = NULL;
+    char *names = NULL;
+    size_t count = 0, cap = 0, used = 0, size = 0;
+    ssize_t n, pos;
+    int stat = 0;
+    while ((n = getdents64(fd, buf, DIRENT_BUF)) != 0) {
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            report("readdir");
+            stat = 1;
+            break;
+        }
+        for (pos = 0; pos < n; pos += ((struct dirent64 *) (buf + pos))->d_reclen) {
+            struct dirent64 *d = (struct dirent64 *) (buf + pos);
+            size_t len = strlen(d->d_name);
+            if (!keep) {
+                if (count++ > 0) {
+                    writer_put(w, "  ", 2);
+                }
+                writer_put(w, d->d_name, len);
+                continue;
+            }
+            // names are stored by offset, the pool moves while it grows
+            if (count == cap) {
+                cap = cap > 0 ? cap * 2 : 1024;
+                struct dir_entry *e = (struct dir_entry *) realloc(entries, cap * sizeof(struct dir_entry));
+                if (e == NULL) {
+                    report("realloc");
+                    stat = 1;
+                    break;
+                }
+                entries = e;
+            }
+            if (used + len + 1 > size) {
+                size = size > 0 ? size * 2 : 65536;
+                while (used + len + 1 > size) {
+                    size *= 2;
+                }
+                char *p = (char *) realloc(names, size);
+                if (p == NULL) {
+                    report("realloc");
+                    stat = 1;
+                    break;
+                }
+                names = p;
+            }
+            memcpy(names + used, d->d_name, len + 1);
+            entries[count].off = used;
+            entries[count].type = d->d_type;
+            count++;
+            used += len + 1;
+        }
+        if (stat != 0) {
+            break;
+        }
+    }
+    if (keep && stat == 0 && count > 0) {
+        for (i = 0; (size_t) i < count; i++) {
+            entries[i].name = names + entries[i].off;
+        }
+        if (sorted) {
+            struct dir_entry *tmp = (struct dir_entry *) malloc(count * sizeof(struct dir_entry));
+            if (tmp == NULL) {
+                report("malloc");
+            } else {
+                sort_names(entries, tmp, count, 0);
+                free(tmp);
+            }
+        }
+        if (longform) {
+            dirlist_long(w, fd, entries, count);
+        } else {
+            for (i = 0; (size_t) i < count; i++) {
+                if (i > 0) {
+                    writer_put(w, "  ", 2);
+                }
+                writer_put(w, entries[i].name, strlen(entries[i].name));
+            }
+        }
+    }
+    if (!longform || count == 0) {
+        writer_put(w, "\n", 1);
+    }
+    if (out_end(w)) {
+        stat = 1;
+    }
+    free(entries);
+    free(names);
+    free(buf);
+    if (close(fd) < 0) {
+        report("closedir");
+    }
+    return stat;
+}
+//-----------------------------------------------------------------------------------
+// One line per entry with type, permissions, size and modification time;
+// the metadata is fetched with statx right after the whole directory was read, the
+// type comes from the directory itself when the file system fills it in
+//-----------------------------------------------------------------------------------
+void dirlist_long(struct writer *w, int dirfd, struct dir_entry *entries, size_t count) {
+    static const char types[16] = {'?', 'p', 'c', '?', 'd', '?', 'b', '?', '-', '?', 'l', '?', 's'};
+    char line[PATH_MAX + 128], date[32];
+    struct statx sx;
+    struct tm tm;
+    time_t t;
+    size_t i;
+    int len;
+    for (i = 0; i < count; i++) {
+        unsigned type = entries[i].type;
+        if (statx(dirfd, entries[i].name, AT_SYMLINK_NOFOLLOW | AT_STATX_DONT_SYNC,
+                (type == DT_UNKNOWN ? STATX_TYPE : 0) | STATX_MODE | STATX_SIZE | STATX_MTIME, &sx) < 0) {
+            report("statx");
+            continue;
+        }
+        unsigned m = sx.stx_mode;
+        // DT_ values are the S_IF ones shifted down
+        if (type == DT_UNKNOWN) {
+            type = (m >> 12) & 15;
+        }
+        t = sx.stx_mtime.tv_sec;
+        localtime_r(&t, &tm);
+        strftime(date, sizeof(date), "%Y-%m-%d %H:%M", &tm);
+        len = snprintf(line, sizeof(line), "%c%c%c%c%c%c%c%c%c%c %12llu %s %s\n", types[type & 15],
+            m & S_IRUSR ? 'r' : '-', m & S_IWUSR ? 'w' : '-', m & S_IXUSR ? 'x' : '-',
+            m & S_IRGRP ? 'r' : '-', m & S_IWGRP ? 'w' : '-', m & S_IXGRP ? 'x' : '-',
+            m & S_IROTH ? 'r' : '-', m & S_IWOTH ? 'w' : '-', m & S_IXOTH ? 'x' : '-',
+            (unsigned long long) sx.stx_size, date, entries[i].name);
+        writer_put(w, line, len < (int) sizeof(line) ? (size_t) len : sizeof(line) - 1);
+    }
+}
+//-----------------------------------------------------------------------------------
+// MSD radix sort of the entries by name, one byte per level; the recursion only goes
+// into the smaller buckets, so its depth stays logarithmic even for long paths
+//-----------------------------------------------------------------------------------
+void sort_names(struct dir_entry *a, struct dir_entry *tmp, size_t n, size_t depth) {
+    size_t count[257], start[257], i, j, big, at;
+    while (1) {
+        // small buckets are cheaper to finish with insertion sort
+        if (n < SORT_SMALL) {
+            for (i = 1; i < n; i++) {
+                struct dir_entry e = a[i];
+                for (j = i; j > 0 && strcmp(a[j-1].name + depth, e.name + depth) > 0; j--) {
+                    a[j] = a[j-1];
+                }
+                a[j] = e;
+            }
+            return;
+        }
+        // the bytes all the names share need no bucketing: paths under one directory
+        // share all of it
+        size_t shared = strlen(a[0].name + depth);
+        for (i = 1; i < n && shared > 0; i++) {
+            for (j = 0; j < shared && a[i].name[depth + j] == a[0].name[depth + j]; j++) {
+            }
+            shared = j;
+        }
+        depth += shared;
+        // bucket 0 holds the names that end at this depth
+        memset(count, 0, sizeof(count));
+        for (i = 0; i < n; i++) {
+            count[(unsigned char) a[i].name[depth] + (a[i].name[depth] != '\0')]++;
+        }
+        for (i = 0, j = 0; i < 257; i++) {
+            start[i] = j;
+            j += count[i];
+        }
+        for (i = 0; i < n; i++) {
+            tmp[start[(unsigned char) a[i].name[depth] + (a[i].name[depth] != '\0')]++] = a[i];
+        }
+        memcpy(a, tmp, n * sizeof(struct dir_entry));
+        // sort the buckets on the next byte, the largest one in this loop
+        for (i = 1, big = 0, at = 0, j = count[0]; i < 257; j += count[i++]) {
+            if (count[i] > count[big] || big == 0) {
+                big = i;
+                at = j;
+            }
+        }
+        for (i = 1, j = count[0]; i < 257; j += count[i++]) {
+            if (i != big && count[i] > 1) {
+                sort_names(a + j, tmp, count[i], depth + 1);
+            }
+        }
+        a += at;
+        n = count[big];
+        depth++;
+    }
+}
+//-----------------------------------------------------------------------------------
+// Create a hard link
+//-----------------------------------------------------------------------------------
+int fun_linkhard(int args) {
+    if (linkat(cwdfd, tokens[1], cwdfd, tokens[2], 0) < 0) {
+        report("linkhard");
+        return 1;
+    }
+    return 0;
+}
+//-----------------------------------------------------------------------------------
+// Create a soft link
+//-----------------------------------------------------------------------------------
+int fun_linksoft(int args) {
+    if (symlinkat(tokens[1], cwdfd, tokens[2]) < 0) {
+        report("linksoft");
+        return 1;
+    }
+    return 0;
+}
+//-----------------------------------------------------------------------------------
+// Print the target of the soft link
+//-----------------------------------------------------------------------------------
+int fun_linkread(int args) {
+    char path[512];
+    int n;
+    if ((n = readlinkat(cwdfd, tokens[1], path, sizeof(path) - 1)) < 0) {
+        report("linkread");
+        return 1;
+    }
+    path[n] = '\0';
+    fprintf(out, "%s\n", path);
+    return 0;
+}
+//-----------------------------------------------------------------------------------
+// Print all links to the file
+//-----------------------------------------------------------------------------------
+int fun_linklist(int args) {
+    // whole tree
+    if (strcmp(tokens[1], "-r") == 0) {
+        if (args < 2) {
+            fprintf(err, "usage: linklist -r file [root]\n");
+            return 1;
+        }
+        struct stat file;
+        if (fstatat(cwdfd, tokens[2], &file, AT_SYMLINK_NOFOLLOW) < 0) {
+            report("stat");
+            return 1;
+        }
+        struct walk *w = (struct walk *) calloc(1, sizeof(struct walk));
+        struct writer *wr = (struct writer *) malloc(sizeof(struct writer));
+        if (w == NULL || wr == NULL) {
+            report("malloc");
+            free(w);
+            free(wr);
+            return 1;
+        }
+        w->visit = walk_link;
+        w->dev = file.st_dev;
+        w->ino = file.st_ino;
+        w->nlink = file.st_nlink;
+        int stat = walk_tree(w, args >= 3 ? tokens[3] : ".");
+        out_flush();
+        writer_init(wr, fileno(out));
+        print_paths(wr, w->found, w->count);
+        if (writer_flush(wr) < 0) {
+            stat = 1;
+        }
+        size_t i;
+        for (i = 0; i < w->count; i++) {
+            free(w->found[i].name);
+        }
+        free(w->found);
+        free(w);
+        free(wr);
+        return stat;
+    }
+    // find file's inode no.
+    struct stat file, dir;
+    if (fstatat(cwdfd, tokens[1], &file, 0) < 0) {
+        report("stat");
+        return 1;
+    }
+    // find files with same inode no. as the given file's
+    DIR *dirp;
+    struct dirent *entry;
+    // open the directory
+    int fd = openat(cwdfd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0 || (dirp = fdopendir(fd)) == NULL) {
+        report("opendir");
+        if (fd >= 0) {
+            close(fd);
+        }
+        return 1;
+    }
+    // an inode number only means the same file on the same device
+    if (fstat(dirfd(dirp), &dir) < 0) {
+        report("stat");
+        closedir(dirp);
+        return 1;
+    }
+    // read the files from the directory and print those with same inode no.
+    int i = 0;
+    while (1) {
+        errno = 0;
+        if ((entry = readdir(dirp)) != NULL) {
+            // reading successful
+            if (entry->d_ino == file.st_ino && dir.st_dev == file.st_dev) {
+                if (i++ > 0) fprintf(out, "  ");
+                fprintf(out, "%s", entry->d_name);
+            }
+        } else {
+            // reading unsuccessful
+            if (errno != 0) {
+                report("readdir");
+                closedir(dirp);
+                return 1;
+            // no more files in the directory, so we close it
+            } else {
+                fprintf(out, "\n");
+                if (closedir(dirp) < 0) {
+                    report("closedir");
+                }
+                break;
+            }
+        }
+    }
+    return 0;
+}
+//-----------------------------------------------------------------------------------
+// Index the hard links of a tree in one pass; print every group of links,
+// or answer for each of the given files
+//-----------------------------------------------------------------------------------
+int fun_linkindex(int args) {
+    struct walk *w = (struct walk *) calloc(1, sizeof(struct walk));
+    struct link_shard *shards = (struct link_shard *) calloc(INDEX_SHARDS, sizeof(struct link_shard));
+    struct writer *wr = (struct writer *) malloc(sizeof(struct writer));
+    struct dir_entry *paths = NULL;
+    size_t i, j, k, count = 0;
+    int stat = 0;
+    if (w == NULL || shards == NULL || wr == NULL) {
+        report("malloc");
+        free(w);
+        free(shards);
+        free(wr);
+        return 1;
+    }
+    for (i = 0; i < INDEX_SHARDS; i++) {
+        pthread_mutex_init(&shards[i].lock, NULL);
+    }
+    w->visit = walk_index;
+    w->shards = shards;
+    stat = walk_tree(w, tokens[1]);
+    out_flush();
+    writer_init(wr, fileno(out));
+    // queries: the links of each file, one line per file
+    if (args > 1) {
+        for (k = 2; k <= (size_t) args; k++) {
+            struct stat file;
+            struct link_node *node = NULL;
+            if (fstatat(cwdfd, tokens[k], &file, AT_SYMLINK_NOFOLLOW) < 0) {
+                report("stat");
+                stat = 1;
+            } else {
+                node = index_find(shards, file.st_dev, file.st_ino);
+            }
+            count = node != NULL ? node->count : 0;
+            if ((paths = (struct dir_entry *) realloc(paths, (count + 1) * sizeof(struct dir_entry))) == NULL) {
+                report("realloc");
+                stat = 1;
+                break;
+            }
+            struct link_path *p;
+            for (i = 0, p = node != NULL ? node->paths : NULL; p != NULL; p = p->next) {
+                paths[i++].name = p->path;
+            }
+            print_paths(wr, paths, count);
+        }
+    // every file with more than one link found, one group per line, sorted
+    } else {
+        struct dir_entry *groups = NULL;
+        size_t ngroups = 0, cap = 0;
+        for (i = 0; i < INDEX_SHARDS; i++) {
+            for (j = 0; j < shards[i].size; j++) {
+                struct link_node *node;
+                for (node = shards[i].buckets[j]; node != NULL; node = node->next) {
+                    if (node->count < 2) {
+                        continue;
+                    }
+                    if (ngroups == cap) {
+                        cap = cap > 0 ? cap * 2 : 256;
+                        struct dir_entry *g = (struct dir_entry *) realloc(groups, cap * sizeof(struct dir_entry));
+                        if (g == NULL) {
+                            report("realloc");
+                            stat = 1;
+                            break;
+                        }
+                        groups = g;
+                    }
+                    // the group is listed under its first path in sorted order
+                    struct link_path *p, *first = node->paths;
+                    for (p = node->paths; p != NULL; p = p->next) {
+                        if (strcmp(p->path, first->path) < 0) {
+                            first = p;
+                        }
+                    }
+                    groups[ngroups].name = first->path;
+                    groups[ngroups].off = (size_t) node;
+                    ngroups++;
+                }
+            }
+        }
+        struct dir_entry *tmp = (struct dir_entry *) malloc((ngroups + 1) * sizeof(struct dir_entry));
+        if (tmp != NULL) {
+            sort_names(groups, tmp, ngroups, 0);
+            free(tmp);
+        }
+        for (k = 0; k < ngroups; k++) {
+            struct link_node *node = (struct link_node *) groups[k].off;
+            if ((paths = (struct dir_entry *) realloc(paths, node->count * sizeof(struct dir_entry))) == NULL) {
+                report("realloc");
+                stat = 1;
+                break;
+            }
+            struct link_path *p;
+            for (i = 0, p = node->paths; p != NULL; p = p->next) {
+                paths[i++].name = p->path;
+            }
+            print_paths(wr, paths, node->count);
+        }
+        free(groups);
+    }
+    if (writer_flush(wr) < 0) {
+        stat = 1;
+    }
+    free(paths);
+    index_free(shards);
+    free(w);
+    free(wr);
+    return stat;
+}
+//-----------------------------------------------------------------------------------
+// Print paths sorted, on one line
+//-----------------------------------------------------------------------------------
+void print_paths(struct writer *wr, struct dir_entry *paths, size_t count) {
+    size_t i;
+    struct dir_entry *tmp = (struct dir_entry *) malloc((count + 1) * sizeof(struct dir_entry));
+    if (tmp != NULL) {
+        sort_names(paths, tmp, count, 0);
+        free(tmp);
+    }
+    for (i = 0; i < count; i++) {
+        if (i > 0) {
+            writer_put(wr, "  ", 2);
+        }
+        writer_put(wr, paths[i].name, strlen(paths[i].name));
+    }
+    writer_put(wr, "\n", 1);
+}
+//-----------------------------------------------------------------------------------
+// Walk the tree under root with a pool of threads, calling w->visit on its files
+//-----------------------------------------------------------------------------------
+int walk_tree(struct walk *w, char *root) {
+    struct walk_thread threads[WALK_THREADS];
+    struct stat st;
+    int i, started = 0;
+    if (fstatat(cwdfd, root, &st, 0) < 0) {
+        report("stat");
+        return 1;
+    }
+    if (!S_ISDIR(st.st_mode)) {
+        fprintf(err, "%s: Not a directory\n", root);
+        return 1;
+    }
+    // directory scans mostly wait for the disk, so there are more threads than CPUs
+    long n = sysconf(_SC_NPROCESSORS_ONLN) * 2;
+    w->threads = n < 2 ? 2 : n > WALK_THREADS ? WALK_THREADS : (int) n;
+    w->cwdfd = cwdfd;
+    w->err = err;
+    pthread_mutex_init(&w->lock, NULL);
+    pthread_mutex_init(&w->idle_lock, NULL);
+    pthread_cond_init(&w->idle, NULL);
+    w->sleeping = 0;
+    w->errors = 0;
+    for (i = 0; i < w->threads; i++) {
+        pthread_mutex_init(&w->deques[i].lock, NULL);
+        w->deques[i].head = w->deques[i].tail = 0;
+        w->deques[i].cap = WALK_DEQUE;
+        if ((w->deques[i].items = (char **) malloc(WALK_DEQUE * sizeof(char *))) == NULL) {
+            int e = errno;
+            report("malloc");
+            exit(e);
+        }
+    }
+    char *path = strdup(root);
+    if (path == NULL) {
+        int e = errno;
+        report("strdup");
+        exit(e);
+    }
+    walk_push(w, 0, path);
+    for (i = 0; i < w->threads; i++) {
+        threads[i].w = w;
+        threads[i].id = i;
+        if (pthread_create(&threads[i].thread, NULL, walk_run, &threads[i]) != 0) {
+            report("pthread_create");
+            break;
+        }
+        started++;
+    }
+    // without any thread the tree is walked right here
+    if (started == 0) {
+        threads[0].w = w;
+        threads[0].id = 0;
+        walk_run(&threads[0]);
+    }
+    for (i = 0; i < started; i++) {
+        pthread_join(threads[i].thread, NULL);
+    }
+    // a walk that stopped early leaves directories behind
+    for (i = 0; i < w->threads; i++) {
+        while ((path = walk_pop(w, i)) != NULL) {
+            free(path);
+        }
+        free(w->deques[i].items);
+        pthread_mutex_destroy(&w->deques[i].lock);
+    }
+    pthread_mutex_destroy(&w->lock);
+    pthread_mutex_destroy(&w->idle_lock);
+    pthread_cond_destroy(&w->idle);
+    return w->errors > 0;
+}
+//-----------------------------------------------------------------------------------
+// Scan directories of our own deque, then steal from the others until none are left
+//-----------------------------------------------------------------------------------
+void *walk_run(void *arg) {
+    struct walk_thread *t = (struct walk_thread *) arg;
+    struct walk *w = t->w;
+    char *buf = (char *) malloc(DIRENT_BUF / 4), *path;
+    int i;
+    cwdfd = w->cwdfd;
+    err = w->err;
+    if (buf == NULL) {
+        report("malloc");
+        return NULL;
+    }
+    while (!__atomic_load_n(&w->stop, __ATOMIC_RELAXED)) {
+        path = walk_pop(w, t->id);
+        // steal the oldest directory of another thread: it has the biggest subtree
+        for (i = 1; path == NULL && i < w->threads; i++) {
+            struct walk_deque *d = &w->deques[(t->id + i) % w->threads];
+            pthread_mutex_lock(&d->lock);
+            if (d->tail > d->head) {
+                path = d->items[d->head++ % d->cap];
+            }
+            pthread_mutex_unlock(&d->lock);
+        }
+        if (path == NULL) {
+            // nothing queued and nothing being scanned that could queue more
+            if (__atomic_load_n(&w->pending, __ATOMIC_ACQUIRE) == 0) {
+                break;
+            }
+            walk_idle(w);
+            continue;
+        }
+        walk_scan(w, t->id, path, buf);
+        free(path);
+        // the last directory ends the walk for those waiting
+        if (__atomic_sub_fetch(&w->pending, 1, __ATOMIC_SEQ_CST) == 0) {
+            walk_wake(w, 1);
+        }
+    }
+    free(buf);
+    return NULL;
+}
+//-----------------------------------------------------------------------------------
+// Queue a directory on a thread's deque
+//-----------------------------------------------------------------------------------
+void walk_push(struct walk *w, int id, char *path) {
+    struct walk_deque *d = &w->deques[id];
+    __atomic_add_fetch(&w->pending, 1, __ATOMIC_RELAXED);
+    pthread_mutex_lock(&d->lock);
+    if (d->tail - d->head == d->cap) {
+        char **items = (char **) malloc(d->cap * 2 * sizeof(char *));
+        if (items == NULL) {
+            int e = errno;
+            report("malloc");
+            exit(e);
+        }
+        size_t i;
+        for (i = d->head; i < d->tail; i++) {
+            items[i - d->head] = d->items[i % d->cap];
+        }
+        free(d->items);
+        d->items = items;
+        d->tail -= d->head;
+        d->head = 0;
+        d->cap *= 2;
+    }
+    d->items[d->tail++ % d->cap] = path;
+    pthread_mutex_unlock(&d->lock);
+    walk_wake(w, 0);
+}
+//-----------------------------------------------------------------------------------
+// Sleep until another thread queues a directory or the walk is over; the count of
+// sleepers goes up before the last look, so a wake can't fall between the two
+//-----------------------------------------------------------------------------------
+void walk_idle(struct walk *w) {
+    int i, empty = 1;
+    pthread_mutex_lock(&w->idle_lock);
+    __atomic_add_fetch(&w->sleeping, 1, __ATOMIC_SEQ_CST);
+    for (i = 0; empty && i < w->threads; i++) {
+        struct walk_deque *d = &w->deques[i];
+        pthread_mutex_lock(&d->lock);
+        empty = d->tail == d->head;
+        pthread_mutex_unlock(&d->lock);
+    }
+    if (empty && __atomic_load_n(&w->pending, __ATOMIC_SEQ_CST) > 0 && !__atomic_load_n(&w->stop, __ATOMIC_SEQ_CST)) {
+        pthread_cond_wait(&w->idle, &w->idle_lock);
+    }
+    __atomic_sub_fetch(&w->sleeping, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&w->idle_lock);
+}
+//-----------------------------------------------------------------------------------
+// Wake one sleeping thread for a queued directory, or all of them when the walk ends
+//-----------------------------------------------------------------------------------
+void walk_wake(struct walk *w, int all) {
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&w->sleeping, __ATOMIC_SEQ_CST) == 0) {
+        return;
+    }
+    pthread_mutex_lock(&w->idle_lock);
+    if (all) {
+        pthread_cond_broadcast(&w->idle);
+    } else {
+        pthread_cond_signal(&w->idle);
+    }
+    pthread_mutex_unlock(&w->idle_lock);
+}
+//-----------------------------------------------------------------------------------
+// Take the newest directory of a thread's own deque
+//-----------------------------------------------------------------------------------
+char *walk_pop(struct walk *w, int id) {
+    struct walk_deque *d = &w->deques[id];
+    char *path = NULL;
+    pthread_mutex_lock(&d->lock);
+    if (d->tail > d->head) {
+        path = d->items[--d->tail % d->cap];
+    }
+    pthread_mutex_unlock(&d->lock);
+    return path;
+}
+//-----------------------------------------------------------------------------------
+// Read a directory: subdirectories are queued, everything else is visited
+//-----------------------------------------------------------------------------------
+void walk_scan(struct walk *w, int id, char *path, char *buf) {
+    struct stat st;
+    ssize_t n, pos;
+    int fd = openat(cwdfd, path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        report(path);
+        __atomic_add_fetch(&w->errors, 1, __ATOMIC_RELAXED);
+        if (fd >= 0) {
+            close(fd);
+        }
+        return;
+    }
+    size_t len = strlen(path);
+    while ((n = getdents64(fd, buf, DIRENT_BUF / 4)) != 0) {
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            report(path);
+            __atomic_add_fetch(&w->errors, 1, __ATOMIC_RELAXED);
+            break;
+        }
+        for (pos = 0; pos < n; pos += ((struct dirent64 *) (buf + pos))->d_reclen) {
+            struct dirent64 *d = (struct dirent64 *) (buf + pos);
+            if (d->d_name[0] == '.' && (d->d_name[1] == '\0' || (d->d_name[1] == '.' && d->d_name[2] == '\0'))) {
+                continue;
+            }
+            unsigned char type = d->d_type;
+            // some file systems don't fill in the type
+            if (type == DT_UNKNOWN) {
+                struct stat sub;
+                if (fstatat(fd, d->d_name, &sub, AT_SYMLINK_NOFOLLOW) < 0) {
+                    continue;
+                }
+                type = S_ISDIR(sub.st_mode) ? DT_DIR : DT_REG;
+            }
+            if (type == DT_DIR) {
+                size_t sublen = strlen(d->d_name);
+                char *sub = (char *) malloc(len + sublen + 2);
+                if (sub == NULL) {
+                    report("malloc");
+                    __atomic_add_fetch(&w->errors, 1, __ATOMIC_RELAXED);
+                    continue;
+                }
+                memcpy(sub, path, len);
+                sub[len] = '/';
+                memcpy(sub + len + 1, d->d_name, sublen + 1);
+                walk_push(w, id, sub);
+            } else {
+                w->visit(w, fd, path, d, st.st_dev);
+            }
+        }
+        if (__atomic_load_n(&w->stop, __ATOMIC_RELAXED)) {
+            break;
+        }
+    }
+    close(fd);
+}
+//-----------------------------------------------------------------------------------
+// linklist -r: keep the entries that are the file we look for
+//-----------------------------------------------------------------------------------
+void walk_link(struct walk *w, int dirfd, char *dir, struct dirent64 *d, dev_t dev) {
+    struct stat st;
+    // the inode number only narrows it down, a bind mount could still be in the way
+    if (d->d_ino != w->ino || dev != w->dev || fstatat(dirfd, d->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0
+            || st.st_ino != w->ino || st.st_dev != w->dev) {
+        return;
+    }
+    char *path = (char *) malloc(strlen(dir) + strlen(d->d_name) + 2);
+    if (path == NULL) {
+        report("malloc");
+        __atomic_add_fetch(&w->errors, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    sprintf(path, "%s/%s", dir, d->d_name);
+    pthread_mutex_lock(&w->lock);
+    if (w->count == w->cap) {
+        w->cap = w->cap > 0 ? w->cap * 2 : 16;
+        struct dir_entry *found = (struct dir_entry *) realloc(w->found, w->cap * sizeof(struct dir_entry));
+        if (found == NULL) {
+            int e = errno;
+            report("realloc");
+            exit(e);
+        }
+        w->found = found;
+    }
+    w->found[w->count++].name = path;
+    // every link was found, the rest of the tree can't have more
+    if (w->count >= w->nlink) {
+        __atomic_store_n(&w->stop, 1, __ATOMIC_SEQ_CST);
+    }
+    pthread_mutex_unlock(&w->lock);
+    if (__atomic_load_n(&w->stop, __ATOMIC_RELAXED)) {
+        walk_wake(w, 1);
+    }
+}
+//-----------------------------------------------------------------------------------
+// linkindex: add the entries with more than one link to the index
+//-----------------------------------------------------------------------------------
+void walk_index(struct walk *w, int dirfd, char *dir, struct dirent64 *d, dev_t dev) {
+    struct statx sx;
+    if (statx(dirfd, d->d_name, AT_SYMLINK_NOFOLLOW | AT_STATX_DONT_SYNC, STATX_NLINK | STATX_INO, &sx) < 0
+            || sx.stx_nlink < 2) {
+        return;
+    }
+    dev = makedev(sx.stx_dev_major, sx.stx_dev_minor);
+    size_t dlen = strlen(dir), nlen = strlen(d->d_name);
+    struct link_path *p = (struct link_path *) malloc(sizeof(struct link_path) + dlen + nlen + 2);
+    if (p == NULL) {
+        report("malloc");
+        __atomic_add_fetch(&w->errors, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    memcpy(p->path, dir, dlen);
+    p->path[dlen] = '/';
+    memcpy(p->path + dlen + 1, d->d_name, nlen + 1);
+    uint64_t h = (uint64_t) sx.stx_ino * 0x9E3779B97F4A7C15ULL ^ dev;
+    struct link_shard *s = &w->shards[h % INDEX_SHARDS];
+    pthread_mutex_lock(&s->lock);
+    struct link_node *node = index_find(w->shards, dev, sx.stx_ino);
+    if (node == NULL) {
+        // grow the shard's table before the chains get long
+        if (s->count >= s->size * 2) {
+            size_t size = s->size > 0 ? s->size * 2 : INDEX_BUCKETS, i;
+            struct link_node **buckets = (struct link_node **) calloc(size, sizeof(struct link_node *));
+            if (buckets == NULL) {
+                int e = errno;
+                report("calloc");
+                exit(e);
+            }
+            for (i = 0; i < s->size; i++) {
+                struct link_node *n, *next;
+                for (n = s->buckets[i]; n != NULL; n = next) {
+                    next = n->next;
+                    uint64_t nh = ((uint64_t) n->ino * 0x9E3779B97F4A7C15ULL ^ n->dev) / INDEX_SHARDS;
+                    n->next = buckets[nh & (size - 1)];
+                    buckets[nh & (size - 1)] = n;
+                }
+            }
+            free(s->buckets);
+            s->buckets = buckets;
+            s->size = size;
+        }
+        if ((node = (struct link_node *) malloc(sizeof(struct link_node))) == NULL) {
+            int e = errno;
+            report("malloc");
+            exit(e);
+        }
+        node->dev = dev;
+        node->ino = sx.stx_ino;
+        node->count = 0;
+        node->paths = NULL;
+        node->next = s->buckets[(h / INDEX_SHARDS) & (s->size - 1)];
+        s->buckets[(h / INDEX_SHARDS) & (s->size - 1)] = node;
+        s->count++;
+    }
+    p->next = node->paths;
+    node->paths = p;
+    node->count++;
+    pthread_mutex_unlock(&s->lock);
+}
+//-----------------------------------------------------------------------------------
+// Look up a file in the index (the caller holds the shard lock while it's built)
+//-----------------------------------------------------------------------------------
+struct link_node *index_find(struct link_shard *shards, dev_t dev, ino_t ino) {
+    uint64_t h = (uint64_t) ino * 0x9E3779B97F4A7C15ULL ^ dev;
+    struct link_shard *s = &shards[h % INDEX_SHARDS];
+    struct link_node *node;
+    if (s->size == 0) {
+        return NULL;
+    }
+    for (node = s->buckets[(h / INDEX_SHARDS) & (s->size - 1)]; node != NULL; node = node->next) {
+        if (node->ino == ino && node->dev == dev) {
+            return node;
+        }
+    }
+    return NULL;
+}
+//-----------------------------------------------------------------------------------
+// Free the index
+//-----------------------------------------------------------------------------------
+void index_free(struct link_shard *shards) {
+    size_t i, j;
+    for (i = 0; i < INDEX_SHARDS; i++) {
+        for (j = 0; j < shards[i].size; j++) {
+            struct link_node *node, *next;
+            for (node = shards[i].buckets[j]; node != NULL; node = next) {
+                struct link_path *p, *pnext;
+                for (p = node->paths; p != NULL; p = pnext) {
+                    pnext = p->next;
+                    free(p);
+                }
+                next = node->next;
+                free(node);
+            }
+        }
+        free(shards[i].buckets);
+        pthread_mutex_destroy(&shards[i].lock);
+    }
+    free(shards);
+}
+//-----------------------------------------------------------------------------------
+// Delete a file
+//-----------------------------------------------------------------------------------
+int fun_unlink(int args) {
+    if (unlinkat(cwdfd, tokens[1], 0) < 0) {
+        report("unlink");
+        return 1;
+    }
+    return 0;
+}
+//-----------------------------------------------------------------------------------
+// Rename a file
+//-----------------------------------------------------------------------------------
+int fun_rename(int args) {
+    if (renameat(cwdfd, tokens[1], cwdfd, tokens[2]) < 0) {
+        report("rename");
+        return 1;
+    }
+    return 0;
+}
+//-----------------------------------------------------------------------------------
+// Start queueing file system builtins
+//-----------------------------------------------------------------------------------
+int fun_batch(int args) {
+    batching = 1;
+    return 0;
+}
+//-----------------------------------------------------------------------------------
+// Run what was queued since batch and return the status of the last command
+//-----------------------------------------------------------------------------------
+int fun_end(int args) {
+    int stat = fs_flush();
+    batching = 0;
+    return stat;
+}
+//-----------------------------------------------------------------------------------
+// Queue the builtin in tokens[0..i]; operations run at the same time unless a path
+// of one is a path of another or lies below it, then the queue is flushed first
+//-----------------------------------------------------------------------------------
+void fs_queue(int b, int i) {
+    struct fs_op *op;
+    int j, n = b == B_LINKSOFT ? 1 : i;
+    // the target of a soft link is only text
+    char *keys[2] = {NULL, NULL};
+    for (j = 0; j < n; j++) {
+        keys[j] = fs_normalize(tokens[i == 1 ? 1 : j + 1 + (b == B_LINKSOFT)], cwd);
+    }
+    // a path with .. can't be placed, so it runs on its own
+    int alone = keys[0] == NULL || (n == 2 && keys[1] == NULL);
+    int needed = 0;
+    for (j = 0; j < n; j++) {
+        char *k;
+        for (k = keys[j]; k != NULL && *k != '\0'; k++) {
+            needed += *k == '/';
+        }
+        needed++;
+    }
+    if (alone || fs_count == BATCH_DEPTH || fs_keys + needed > BATCH_SET / 2
+            || fs_conflict(keys[0]) || (n == 2 && fs_conflict(keys[1]))) {
+        fs_flush();
+    }
+    op = &fs_ops[fs_count++];
+    op->b = b;
+    op->res = 0;
+    op->dirfd = cwdfd;
+    op->path[0] = strdup(tokens[1]);
+    op->path[1] = i == 2 ? strdup(tokens[2]) : NULL;
+    op->key[0] = keys[0];
+    op->key[1] = keys[1];
+    if (op->path[0] == NULL || (i == 2 && op->path[1] == NULL)) {
+        int e = errno;
+        report("strdup");
+        exit(e);
+    }
+    for (j = 0; j < n; j++) {
+        char *k;
+        if (keys[j] == NULL) {
+            continue;
+        }
+        for (k = keys[j] + 1; *k != '\0'; k++) {
+            if (*k == '/') {
+                fs_mark(keys[j], k - keys[j], KEY_ABOVE);
+            }
+        }
+        fs_mark(keys[j], k - keys[j], KEY_TOUCHED);
+    }
+    if (alone) {
+        fs_flush();
+    }
+}
+//-----------------------------------------------------------------------------------
+// Absolute path without . components and extra slashes, NULL when it has ..; relative
+// paths are in directory dir
+//-----------------------------------------------------------------------------------
+char *fs_normalize(char *path, char *dir) {
+    size_t base = path[0] == '/' ? 0 : strlen(dir), len;
+    char *key = (char *) malloc(base + strlen(path) + 2), *p = path, *q;
+    if (key == NULL) {
+        int e = errno;
+        report("malloc");
+        exit(e);
+    }
+    memcpy(key, dir, base);
+    q = key + (base == 1 ? 0 : base);
+    while (*p != '\0') {
+        while (*p == '/') {
+            p++;
+        }
+        for (len = 0; p[len] != '\0' && p[len] != '/'; len++) { }
+        if (len == 2 && p[0] == '.' && p[1] == '.') {
+            free(key);
+            return NULL;
+        }
+        if (len > 0 && !(len == 1 && p[0] == '.')) {
+            *q++ = '/';
+            memcpy(q, p, len);
+            q += len;
+        }
+        p += len;
+    }
+    if (q == key) {
+        *q++ = '/';
+    }
+    *q = '\0';
+    return key;
+}
+//-----------------------------------------------------------------------------------
+// Kind of a path in the set of queued paths, 0 when it isn't there
+//-----------------------------------------------------------------------------------
+int fs_find(char *key, size_t len) {
+    unsigned h = 2166136261u;
+    size_t i;
+    for (i = 0; i < len; i++) {
+        h = (h ^ (unsigned char) key[i]) * 16777619u;
+    }
+    for (i = h & (BATCH_SET - 1); fs_set[i].key != NULL; i = (i + 1) & (BATCH_SET - 1)) {
+        if (fs_set[i].len == len && memcmp(fs_set[i].key, key, len) == 0) {
+            return fs_set[i].kind;
+        }
+    }
+    return 0;
+}
+//-----------------------------------------------------------------------------------
+// Add a path to the set
+//-----------------------------------------------------------------------------------
+void fs_mark(char *key, size_t len, int kind) {
+    unsigned h = 2166136261u;
+    size_t i;
+    for (i = 0; i < len; i++) {
+        h = (h ^ (unsigned char) key[i]) * 16777619u;
+    }
+    for (i = h & (BATCH_SET - 1); fs_set[i].key != NULL; i = (i + 1) & (BATCH_SET - 1)) {
+        if (fs_set[i].len == len && memcmp(fs_set[i].key, key, len) == 0) {
+            fs_set[i].kind |= kind;
+            return;
+        }
+    }
+    fs_set[i].key = key;
+    fs_set[i].len = len;
+    fs_set[i].kind = kind;
+    fs_used[fs_keys++] = i;
+}
+//-----------------------------------------------------------------------------------
+// Does a path clash with the queued ones: the same path, one of its parents,
+// or something inside it
+//-----------------------------------------------------------------------------------
+int fs_conflict(char *key) {
+    char *k;
+    if (key == NULL || fs_find(key, strlen(key)) != 0) {
+        return key != NULL;
+    }
+    for (k = key + 1; *k != '\0'; k++) {
+        if (*k == '/' && (fs_find(key, k - key) & KEY_TOUCHED)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+//-----------------------------------------------------------------------------------
+// Run the queued operations, report their errors in order like the builtins do,
+// and return the status of the last one
+//-----------------------------------------------------------------------------------
+int fs_flush() {
+    int i;
+    if (fs_count == 0) {
+        return status;
+    }
+    if (uring.fd == -1) {
+        ring_setup();
+    }
+    if (uring.fd >= 0) {
+        ring_submit();
+    } else {
+        for (i = 0; i < fs_count; i++) {
+            fs_ops[i].res = fs_run(&fs_ops[i]);
+        }
+    }
+    for (i = 0; i < fs_count; i++) {
+        struct fs_op *op = &fs_ops[i];
+        if (op->res < 0) {
+            fprintf(err, "%s: %s\n", builtins[op->b].name, strerror(-op->res));
+        }
+        status = op->res < 0;
+        free(op->path[0]);
+        free(op->path[1]);
+        free(op->key[0]);
+        free(op->key[1]);
+    }
+    fs_count = 0;
+    for (i = 0; i < fs_keys; i++) {
+        fs_set[fs_used[i]].key = NULL;
+    }
+    fs_keys = 0;
+    return status;
+}
+//-----------------------------------------------------------------------------------
+// Set up the ring, or mark it unavailable when the kernel lacks any of the operations
+//-----------------------------------------------------------------------------------
+void ring_setup() {
+    static const int ops[] = {IORING_OP_MKDIRAT, IORING_OP_UNLINKAT, IORING_OP_LINKAT,
+        IORING_OP_SYMLINKAT, IORING_OP_RENAMEAT};
+    struct io_uring_params p;
+    unsigned i;
+    uring.fd = -2;
+    memset(&p, 0, sizeof(p));
+    int fd = syscall(__NR_io_uring_setup, BATCH_DEPTH, &p);
+    if (fd < 0) {
+        return;
+    }
+    struct io_uring_probe *probe = (struct io_uring_probe *) calloc(1, sizeof(struct io_uring_probe)
+        + 256 * sizeof(struct io_uring_probe_op));
+    if (probe == NULL || syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, 256) < 0) {
+        free(probe);
+        close(fd);
+        return;
+    }
+    for (i = 0; i < sizeof(ops) / sizeof(ops[0]); i++) {
+        if (ops[i] > probe->last_op || !(probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED)) {
+            free(probe);
+            close(fd);
+            return;
+        }
+    }
+    free(probe);
+    // the submission and completion rings share one mapping on current kernels
+    size_t sqsize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cqsize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if ((p.features & IORING_FEAT_SINGLE_MMAP) && cqsize > sqsize) {
+        sqsize = cqsize;
+    }
+    char *sq = (char *) mmap(NULL, sqsize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    char *cq = sq;
+    if (sq != MAP_FAILED && !(p.features & IORING_FEAT_SINGLE_MMAP)) {
+        cq = (char *) mmap(NULL, cqsize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    }
+    void *sqes = MAP_FAILED;
+    if (sq != MAP_FAILED && cq != MAP_FAILED) {
+        sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    }
+    uring.sq = sq;
+    uring.cq = cq;
+    uring.sqes = (struct io_uring_sqe *) sqes;
+    uring.sq_size = sqsize;
+    uring.cq_size = cqsize;
+    uring.sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    if (sq == MAP_FAILED || cq == MAP_FAILED || sqes == MAP_FAILED) {
+        report("mmap");
+        ring_close(fd, -2);
+        return;
+    }
+    uring.sq_tail = (unsigned *) (sq + p.sq_off.tail);
+    uring.sq_mask = (unsigned *) (sq + p.sq_off.ring_mask);
+    uring.sq_array = (unsigned *) (sq + p.sq_off.array);
+    uring.cq_head = (unsigned *) (cq + p.cq_off.head);
+    uring.cq_tail = (unsigned *) (cq + p.cq_off.tail);
+    uring.cq_mask = (unsigned *) (cq + p.cq_off.ring_mask);
+    uring.cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+    uring.fd = fd;
+}
+//-----------------------------------------------------------------------------------
+// Take the ring down: unmap what was mapped and close it; state is what uring.fd
+// becomes, -1 to set it up again on the next flush, -2 to do without it
+//-----------------------------------------------------------------------------------
+void ring_close(int fd, int state) {
+    if (uring.sqes != MAP_FAILED) {
+        munmap(uring.sqes, uring.sqes_size);
+    }
+    if (uring.cq != MAP_FAILED && uring.cq != uring.sq) {
+        munmap(uring.cq, uring.cq_size);
+    }
+    if (uring.sq != MAP_FAILED) {
+        munmap(uring.sq, uring.sq_size);
+    }
+    close(fd);
+    uring.fd = state;
+}
+//-----------------------------------------------------------------------------------
+// Submit the queue in one system call and collect every completion
+//-----------------------------------------------------------------------------------
+void ring_submit() {
+    unsigned tail = *uring.sq_tail, mask = *uring.sq_mask;
+    int i, submitted = 0, done = 0, n;
+    for (i = 0; i < fs_count; i++) {
+        struct fs_op *op = &fs_ops[i];
+        unsigned idx = (tail + i) & mask;
+        struct io_uring_sqe *sqe = &uring.sqes[idx];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->fd = op->dirfd;
+        sqe->addr = (unsigned long) op->path[0];
+        sqe->user_data = i;
+        // no operation completes with a positive result
+        op->res = 1;
+        switch (op->b) {
+        case B_DIRMAKE:
+            sqe->opcode = IORING_OP_MKDIRAT;
+            sqe->len = S_IRWXU;
+            break;
+        case B_DIRREMOVE:
+            sqe->opcode = IORING_OP_UNLINKAT;
+            sqe->unlink_flags = AT_REMOVEDIR;
+            break;
+        case B_UNLINK:
+            sqe->opcode = IORING_OP_UNLINKAT;
+            break;
+        case B_LINKSOFT:
+            sqe->opcode = IORING_OP_SYMLINKAT;
+            sqe->addr2 = (unsigned long) op->path[1];
+            break;
+        case B_LINKHARD:
+            sqe->opcode = IORING_OP_LINKAT;
+            sqe->len = op->dirfd;
+            sqe->addr2 = (unsigned long) op->path[1];
+            break;
+        case B_RENAME:
+            sqe->opcode = IORING_OP_RENAMEAT;
+            sqe->len = op->dirfd;
+            sqe->addr2 = (unsigned long) op->path[1];
+            break;
+        }
+        uring.sq_array[idx] = idx;
+    }
+    __atomic_store_n(uring.sq_tail, tail + fs_count, __ATOMIC_RELEASE);
+    while (done < fs_count) {
+        n = syscall(__NR_io_uring_enter, uring.fd, fs_count - submitted, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            report("io_uring_enter");
+            __atomic_store_n(uring.sq_tail, tail + submitted, __ATOMIC_RELEASE);
+            // what the kernel took completes before the ring is used again, or the next
+            // batch would take the completions for its own; if it can't even wait for
+            // them, they go with the ring
+            while (done < submitted) {
+                if (syscall(__NR_io_uring_enter, uring.fd, 0, submitted - done, IORING_ENTER_GETEVENTS, NULL, 0) < 0
+                        && errno != EINTR) {
+                    report("io_uring_enter");
+                    ring_close(uring.fd, -1);
+                    break;
+                }
+                done += ring_reap();
+            }
+            // what the kernel didn't take runs the plain way, what it lost fails
+            for (i = 0; i < fs_count; i++) {
+                if (fs_ops[i].res == 1) {
+                    fs_ops[i].res = i >= submitted ? fs_run(&fs_ops[i]) : -EIO;
+                }
+            }
+            return;
+        }
+        submitted += n;
+        done += ring_reap();
+    }
+}
+//-----------------------------------------------------------------------------------
+// Hand the completions that are in to their operations and return how many there were
+//-----------------------------------------------------------------------------------
+int ring_reap() {
+    unsigned head = *uring.cq_head;
+    int n = 0;
+    while (head != __atomic_load_n(uring.cq_tail, __ATOMIC_ACQUIRE)) {
+        struct io_uring_cqe *cqe = &uring.cqes[head & *uring.cq_mask];
+        fs_ops[cqe->user_data].res = cqe->res;
+        head++;
+        n++;
+    }
+    __atomic_store_n(uring.cq_head, head, __ATOMIC_RELEASE);
+    return n;
+}
+//-----------------------------------------------------------------------------------
+// One operation as a plain system call, the result like a completion's
+//-----------------------------------------------------------------------------------
+int fs_run(struct fs_op *op) {
+    int r = 0;
+    switch (op->b) {
+    case B_DIRMAKE: r = mkdirat(op->dirfd, op->path[0], S_IRWXU); break;
+    case B_DIRREMOVE: r = unlinkat(op->dirfd, op->path[0], AT_REMOVEDIR); break;
+    case B_UNLINK: r = unlinkat(op->dirfd, op->path[0], 0); break;
+    case B_LINKSOFT: r = symlinkat(op->path[0], op->dirfd, op->path[1]); break;
+    case B_LINKHARD: r = linkat(op->dirfd, op->path[0], op->dirfd, op->path[1], 0); break;
+    case B_RENAME: r = renameat(op->dirfd, op->path[0], op->dirfd, op->path[1]); break;
+    }
+    return r < 0 ? -errno : 0;
+}
+//-----------------------------------------------------------------------------------
+// Copy a file or print its content to the standard output
+//-----------------------------------------------------------------------------------
+int fun_cpcat(int args) {
+    int fdin = in;
+    // open the descriptor: input from file
+    if (args >= 1 && strcmp(tokens[1], "-") != 0) {
+        if ((fdin = openat(cwdfd, tokens[1], O_RDONLY | O_CLOEXEC)) < 0) {
+            report("open");
+            return 1;
+        }
+    } else if (input_claim(fdin) < 0) {
+        fprintf(err, "cpcat: standard input holds the script\n");
+        return 1;
+    }
+    int fdout = fileno(out);
+    out_flush();
+    // open the descriptor: output to file
+    if (args == 2 && strcmp(tokens[2], "-") != 0) {
+        if ((fdout = openat(cwdfd, tokens[2], O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666)) < 0) {
+            report("open");
+            if (fdin != in) {
+                close(fdin);
+            }
+            return 1;
+        }
+    }
+    // copy the content of the input file into the output file
+    off_t copied = copy_fd(fdin, fdout);
+    int stat = copied < 0;
+    if (copied > 0) {
+        stat_add(&stats.copied, copied);
+    }
+    // close the descriptors
+    if (fdin != in && close(fdin) < 0) {
+        int e = errno;
+        report("close");
+        exit(e);
+    }
+    if (fdout != fileno(out) && close(fdout) < 0) {
+        int e = errno;
+        report("close");
+        exit(e);
+    }
+    return stat;
+}
+//-----------------------------------------------------------------------------------
+// Stream one descriptor into another with the cheapest copy the kernel offers
+//-----------------------------------------------------------------------------------
+off_t copy_fd(int fdin, int fdout) {
+    struct stat stin, stout;
+    off_t total = 0;
+    ssize_t n;
+    if (fstat(fdin, &stin) < 0 || fstat(fdout, &stout) < 0) {
+        report("fstat");
+        return -1;
+    }
+    // file to file: copied inside the kernel, holes included
+    if (S_ISREG(stin.st_mode) && S_ISREG(stout.st_mode)) {
+        return copy_file(fdin, fdout, &stin, &stout);
+    }
+    // file to pipe or socket: sent straight from the page cache
+    if (S_ISREG(stin.st_mode) && (S_ISFIFO(stout.st_mode) || S_ISSOCK(stout.st_mode))) {
+        while ((n = sendfile(fdout, fdin, NULL, COPY_CHUNK)) != 0) {
+            if (n > 0) {
+                total += n;
+            } else if (errno == EINVAL || errno == ENOSYS) {
+                break;
+            } else if (errno != EINTR) {
+                // the reader went away, like a killed process this is not worth a word
+                if (errno != EPIPE) {
+                    report("sendfile");
+                }
+                return -1;
+            }
+        }
+        if (n == 0) {
+            return total;
+        }
+    // either end is a pipe: pages are moved instead of copied
+    } else if (S_ISFIFO(stin.st_mode) || S_ISFIFO(stout.st_mode)) {
+        while ((n = splice(fdin, NULL, fdout, NULL, COPY_CHUNK, SPLICE_F_MOVE | SPLICE_F_MORE)) != 0) {
+            if (n > 0) {
+                total += n;
+            } else if (errno == EINVAL || errno == ENOSYS) {
+                break;
+            } else if (errno != EINTR) {
+                if (errno != EPIPE) {
+                    report("splice");
+                }
+                return -1;
+            }
+        }
+        if (n == 0) {
+            return total;
+        }
+    }
+    // anything else (terminals, devices) goes through a buffer
+    if ((n = copy_buffered(fdin, fdout, NULL, NULL, -1)) < 0) {
+        return -1;
+    }
+    return total + n;
+}
+//-----------------------------------------------------------------------------------
+// Copy a regular file into a regular file, skipping holes with SEEK_DATA/SEEK_HOLE
+//-----------------------------------------------------------------------------------
+off_t copy_file(int fdin, int fdout, struct stat *stin, struct stat *stout) {
+    off_t inpos = lseek(fdin, 0, SEEK_CUR), outpos = lseek(fdout, 0, SEEK_CUR);
+    off_t end = stin->st_size, total = 0, data, hole, n;
+    if (inpos < 0 || outpos < 0) {
+        report("lseek");
+        return -1;
+    }
+    // holes may only be skipped where the output has no old content to overwrite
+    int sparse = stout->st_size <= outpos;
+    while (inpos < end) {
+        data = inpos;
+        hole = end;
+        if (sparse) {
+            if ((data = lseek(fdin, inpos, SEEK_DATA)) < 0) {
+                // only a hole is left, or the file system can't tell
+                data = errno == ENXIO ? end : inpos;
+            }
+            if (data < end && (hole = lseek(fdin, data, SEEK_HOLE)) < 0) {
+                hole = end;
+            }
+        }
+        outpos += data - inpos;
+        inpos = data;
+        if (data >= end) {
+            break;
+        }
+        if ((n = copy_range(fdin, fdout, &inpos, &outpos, hole - data)) < 0) {
+            return -1;
+        }
+        total += n;
+        // the file got shorter while we were copying it
+        if (n < hole - data) {
+            break;
+        }
+    }
+    // a trailing hole still counts towards the size
+    if (sparse && ftruncate(fdout, outpos) < 0) {
+        report("ftruncate");
+    }
+    // the copy used explicit offsets, so move the descriptors past it
+    if (lseek(fdin, inpos, SEEK_SET) < 0 || lseek(fdout, outpos, SEEK_SET) < 0) {
+        report("lseek");
+    }
+    return total;
+}
+//-----------------------------------------------------------------------------------
+// Copy a range between files with copy_file_range, or a buffer when it's unsupported
+//-----------------------------------------------------------------------------------
+off_t copy_range(int fdin, int fdout, off_t *inoff, off_t *outoff, off_t len) {
+    off_t total = 0, n;
+    while (total < len) {
+        n = copy_file_range(fdin, inoff, fdout, outoff, len - total > COPY_CHUNK ? COPY_CHUNK : len - total, 0);
+        if (n > 0) {
+            total += n;
+        } else if (n == 0) {
+            break;
+        } else if (errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP || errno == EBADF) {
+            if ((n = copy_buffered(fdin, fdout, inoff, outoff, len - total)) < 0) {
+                return -1;
+            }
+            return total + n;
+        } else if (errno != EINTR) {
+            report("copy_file_range");
+            return -1;
+        }
+    }
+    return total;
+}
+//-----------------------------------------------------------------------------------
+// Copy through an aligned buffer, at explicit offsets when they are given,
+// until len bytes (or the end of the input when len < 0) are copied
+//-----------------------------------------------------------------------------------
+off_t copy_buffered(int fdin, int fdout, off_t *inoff, off_t *outoff, off_t len) {
+    static __thread char *buffer = NULL;
+    off_t total = 0;
+    ssize_t n, w, done;
+    size_t want;
+    if (buffer == NULL && (errno = posix_memalign((void **) &buffer, COPY_ALIGN, COPY_BUF)) != 0) {
+        report("posix_memalign");
+        buffer = NULL;
+        return -1;
+    }
+    while (len < 0 || total < len) {
+        want = COPY_BUF;
+        if (len >= 0 && len - total < COPY_BUF) {
+            want = len - total;
+        }
+        n = inoff != NULL ? pread(fdin, buffer, want, *inoff) : read(fdin, buffer, want);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            report("read");
+            return -1;
+        } else if (n == 0) {
+            break;
+        }
+        if (inoff != NULL) {
+            *inoff += n;
+        }
+        // the output may take less than it was offered
+        for (done = 0; done < n; done += w) {
+            w = outoff != NULL ? pwrite(fdout, buffer + done, n - done, *outoff) : write(fdout, buffer + done, n - done);
+            if (w < 0) {
+                if (errno == EINTR) {
+                    w = 0;
+                    continue;
+                }
+                if (errno != EPIPE) {
+                    report("write");
+                }
+                return -1;
+            }
+            if (outoff != NULL) {
+                *outoff += w;
+            }
+        }
+        total += n;
+    }
+    return total;
+}
+//-----------------------------------------------------------------------------------
+// Create pipeline
+//-----------------------------------------------------------------------------------
+int fun_pipes(int args) {
+    stat_add(&stats.stages, args);
+    // parse the pipeline commands
+    int i, j = 0, k = 0;
+    count = (int *) arena_alloc(args * sizeof(int));
+    split = (char ***) arena_alloc(args * sizeof(char **));
+    for (i = 1; i <= args; i++) {
+        // the words are cut in place, so the stage needs only the pointer array
+        split[j] = (char **) arena_alloc((strlen(tokens[i])/2 + 2) * sizeof(char *));
+        char *p = strtok(tokens[i], " ");
+        while (p != NULL) {
+            split[j][k++] = p;
+            p = strtok(NULL, " ");
+        }
+        split[j][k] = NULL;
+        count[j] = k-1;
+        j++;
+        k = 0;
+    }
+    stages = (struct stage *) arena_alloc(args * sizeof(struct stage));
+    memset(stages, 0, args * sizeof(struct stage));
+    // create a pipeline
+    int fd1[2];
+    int fd2[2];
+    if (pipe2(fd1, O_CLOEXEC) < 0) {
+        report("pipe");
+    }
+    pipe_start(fd1, 0);
+    for (i = 1; i < args-1; i++) {
+        if (pipe2(fd2, O_CLOEXEC) < 0) {
+            report("pipe");
+        }
+        pipe_middle(fd1, fd2, i);
+        memcpy(fd1, fd2, 2*sizeof(int));
+    }
+    if (args < 3) {
+        pipe_end(fd1, i);
+    } else {
+        pipe_end(fd2, i);
+    }
+    // wait for the stages, processes by their pid so background jobs are left alone
+    int stat;
+    for (i = 0; i < args; i++) {
+        if (stages[i].pid > 0) {
+            uint64_t t = trace_start();
+            if (waitpid(stages[i].pid, &stat, 0) < 0) {
+                report("waitpid");
+            } else {
+                stages[i].status = exit_status(stat);
+            }
+            trace_end(T_WAIT, split[i][0], t);
+        } else if (stages[i].started) {
+            pthread_join(stages[i].thread, NULL);
+        }
+    }
+    out_flush();
+    // the pipeline's status is that of its last stage
+    return stages[args-1].status;
+}
+//-----------------------
+// Start of pipeline
+//-----------------------
+void pipe_start(int fd[], int i) {
+    int pid, b = stage_inline(i);
+    uint64_t tf = trace_start();
+    // external commands are spawned straight onto the pipe
+    if (b < 0 && find_builtin(split[i][0]) < 0) {
+        stages[i].pid = spawn(split[i], -1, fd[1], NULL, 0);
+    // builtins that leave the shell alone write into the pipe from a thread
+    } else if (b >= 0) {
+        stage_start(i, b, in, fd[1]);
+    } else if ((pid = fork()) < 0) {
+        report("fork");
+    } else if (pid > 0) {
+        trace_end(T_FORK, split[i][0], tf);
+        stat_add(&stats.forks, 1);
+        stages[i].pid = pid;
+    } else {
+        // redirect child's standard output to the writing end of the 1st pipe
+        if (dup2(fd[1], 1) < 0) {
+            report("dup2");
+        }
+        out = stdout;
+        // close the descriptors
+        if (close(fd[0]) < 0) {
+            report("close");
+        }
+        if (close(fd[1]) < 0) {
+            report("close");
+        }
+        child_exit(fun_exec_internal(i));
+    }
+}
+//-----------------------
+// Middle of pipeline
+//-----------------------
+void pipe_middle(int fd1[], int fd2[], int i) {
+    int pid, b = stage_inline(i);
+    uint64_t tf = trace_start();
+    // external commands are spawned straight onto the pipes
+    if (b < 0 && find_builtin(split[i][0]) < 0) {
+        stages[i].pid = spawn(split[i], fd1[0], fd2[1], NULL, 0);
+    // builtins that leave the shell alone run on a thread between the pipes
+    } else if (b >= 0) {
+        stage_start(i, b, fd1[0], fd2[1]);
+    } else if ((pid = fork()) < 0) {
+        report("fork");
+    } else if (pid > 0) {
+        trace_end(T_FORK, split[i][0], tf);
+        stat_add(&stats.forks, 1);
+        stages[i].pid = pid;
+    } else {
+        // redirect child's standard input to the reading end of the 1st pipe
+        if (dup2(fd1[0], 0) < 0) {
+            report("dup2");
+        }
+        // redirect child's standard output to the writing end of the 2nd pipe
+        if (dup2(fd2[1], 1) < 0) {
+            report("dup2");
+        }
+        in = 0;
+        out = stdout;
+        // close the descriptors
+        if (close(fd1[0]) < 0) {
+            report("close");
+        }
+        if (close(fd1[1]) < 0) {
+            report("close");
+        }
+        if (close(fd2[0]) < 0) {
+            report("close");
+        }
+        if (close(fd2[1]) < 0) {
+            report("close");
+        }
+        child_exit(fun_exec_internal(i));
+    }
+    // close the descriptors
+    if (close(fd1[0]) < 0) {
+        report("close");
+    }
+    if (close(fd1[1]) < 0) {
+        report("close");
+    }
+}
+//-----------------------
+// End of pipeline
+//-----------------------
+void pipe_end(int fd[], int i) {
+    int pid, b = stage_inline(i);
+    uint64_t tf = trace_start();
+    // nothing but the last stage may keep the pipe open for writing
+    if (close(fd[1]) < 0) {
+        report("close");
+    }
+    // external commands are spawned straight onto the pipe
+    if (b < 0 && find_builtin(split[i][0]) < 0) {
+        stages[i].pid = spawn(split[i], fd[0], -1, NULL, 0);
+    // builtins that leave the shell alone read the pipe right here
+    } else if (b >= 0) {
+        int saved = in;
+        tokens = split[i];
+        in = fd[0];
+        stages[i].status = builtins[b].fun(count[i]);
+        in = saved;
+    } else if ((pid = fork()) < 0) {
+        report("fork");
+    } else if (pid > 0) {
+        trace_end(T_FORK, split[i][0], tf);
+        stat_add(&stats.forks, 1);
+        stages[i].pid = pid;
+    } else {
+        // redirect child's standard input to the reading end of the 2nd pipe
+        if (dup2(fd[0], 0) < 0) {
+            report("dup2");
+        }
+        in = 0;
+        // close the descriptors
+        if (close(fd[0]) < 0) {
+            report("close");
+        }
+        child_exit(fun_exec_internal(i));
+    }
+    // close the descriptors
+    if (close(fd[0]) < 0) {
+        report("close");
+    }
+}
+//-----------------------------------------------------------------------------------
+// Builtin that can run as a pipeline stage inside the shell, or -1
+//-----------------------------------------------------------------------------------
+int stage_inline(int i) {
+    int b = find_builtin(split[i][0]);
+    if (b < 0 || (builtins[b].flags & BI_SAFE) == 0) {
+        return -1;
+    }
+    // a stage with missing operands is reported by the forked path
+    if (count[i] < builtins[b].args) {
+        return -1;
+    }
+    return b;
+}
+//-----------------------------------------------------------------------------------
+// Run a builtin stage on a thread with its own copies of the pipe descriptors
+//-----------------------------------------------------------------------------------
+void stage_start(int i, int b, int fdin, int fdout) {
+    struct stage *st = &stages[i];
+    st->b = b;
+    st->args = count[i];
+    st->argv = split[i];
+    // the thread works in the shell's (or the session's) directory and state
+    st->err = err;
+    st->cwdfd = cwdfd;
+    st->cwd = cwd;
+    st->status = status;
+    if ((st->in = fcntl(fdin, F_DUPFD_CLOEXEC, 0)) < 0) {
+        report("fcntl");
+        return;
+    }
+    if ((st->out = fcntl(fdout, F_DUPFD_CLOEXEC, 0)) < 0) {
+        report("fcntl");
+        close(st->in);
+        return;
+    }
+    if ((errno = pthread_create(&st->thread, NULL, stage_run, st)) != 0) {
+        report("pthread_create");
+        close(st->in);
+        close(st->out);
+    } else {
+        st->started = 1;
+    }
+}
+//-----------------------------------------------------------------------------------
+// Pipeline stage thread
+//-----------------------------------------------------------------------------------
+void *stage_run(void *arg) {
+    struct stage *st = (struct stage *) arg;
+    tokens = st->argv;
+    token_count = st->args + 1;
+    in = st->in;
+    err = st->err;
+    cwdfd = st->cwdfd;
+    cwd = st->cwd;
+    status = st->status;
+    // closing the output is what tells the next stage there's nothing more
+    if ((out = fdopen(st->out, "w")) == NULL) {
+        report("fdopen");
+        close(st->out);
+    } else {
+        st->status = builtins[st->b].fun(st->args);
+        out_close();
+    }
+    close(st->in);
+    arena_free();
+    free(output);
+    output = NULL;
+    trace_release();
+    return NULL;
+}
+//-----------------------------------------------------------------------------------
+// Queue a builtin for the worker pool, with its own copy of the arguments and
+// of the standard descriptors as they are redirected right now
+//-----------------------------------------------------------------------------------
+int task_submit(int b, int args, int job) {
+    int i;
+    size_t size = sizeof(struct task) + (args + 2) * sizeof(char *), len;
+    for (i = 0; i <= args; i++) {
+        size += strlen(tokens[i]) + 1;
+    }
+    struct task *t = (struct task *) malloc(size);
+    if (t == NULL) {
+        report("malloc");
+        return -1;
+    }
+    t->b = b;
+    t->args = args;
+    t->job = job;
+    t->status = EXIT_FAILURE;
+    t->argv = (char **) (t + 1);
+    char *p = (char *) (t->argv + args + 2);
+    for (i = 0; i <= args; i++) {
+        len = strlen(tokens[i]) + 1;
+        t->argv[i] = memcpy(p, tokens[i], len);
+        p += len;
+    }
+    t->argv[args+1] = NULL;
+    out_flush();
+    fflush(err);
+    // the task keeps the directory it was started in, while dir moves the shell on
+    t->out = t->err = -1;
+    t->cwdfd = AT_FDCWD;
+    t->cwd = NULL;
+    if ((t->in = fcntl(in, F_DUPFD_CLOEXEC, 0)) < 0 || (t->out = fcntl(fileno(out), F_DUPFD_CLOEXEC, 0)) < 0
+            || (t->err = fcntl(fileno(err), F_DUPFD_CLOEXEC, 0)) < 0
+            || (cwdfd != AT_FDCWD && (t->cwdfd = fcntl(cwdfd, F_DUPFD_CLOEXEC, 0)) < 0)
+            || (t->cwd = strdup(cwd)) == NULL) {
+        report("task");
+        task_release(t);
+        free(t);
+        return -1;
+    }
+    t->next = NULL;
+    pthread_mutex_lock(&task_lock);
+    // start the workers on first use, with an eventfd that tells when they finish
+    if (worker_count == 0) {
+        if (task_event < 0 && (task_event = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+            report("eventfd");
+        }
+        for (i = 0; i < WORKERS; i++) {
+            if ((errno = pthread_create(&workers[worker_count], NULL, worker, NULL)) != 0) {
+                report("pthread_create");
+            } else {
+                worker_count++;
+            }
+        }
+        pthread_atfork(NULL, NULL, tasks_forget);
+    }
+    if (worker_count == 0) {
+        pthread_mutex_unlock(&task_lock);
+        task_release(t);
+        free(t);
+        return -1;
+    }
+    if (task_tail != NULL) {
+        task_tail->next = t;
+    } else {
+        task_head = t;
+    }
+    task_tail = t;
+    task_pending++;
+    pthread_cond_signal(&task_ready);
+    pthread_mutex_unlock(&task_lock);
+    return 0;
+}
+//-----------------------------------------------------------------------------------
+// Worker thread: run queued builtins one after another
+//-----------------------------------------------------------------------------------
+void *worker(void *arg) {
+    struct task *t;
+    while (1) {
+        pthread_mutex_lock(&task_lock);
+        while (task_head == NULL) {
+            pthread_cond_wait(&task_ready, &task_lock);
+        }
+        t = task_head;
+        if ((task_head = t->next) == NULL) {
+            task_tail = NULL;
+        }
+        pthread_mutex_unlock(&task_lock);
+        // run the builtin on the task's arguments and descriptors
+        tokens = t->argv;
+        token_count = t->args + 1;
+        in = t->in;
+        cwdfd = t->cwdfd;
+        cwd = t->cwd;
+        // errors are written as they happen, like on stderr
+        if ((err = fdopen(t->err, "w")) == NULL) {
+            err = stderr;
+            report("fdopen");
+            close(t->err);
+        } else {
+            setvbuf(err, NULL, _IONBF, 0);
+        }
+        if ((out = fdopen(t->out, "w")) == NULL) {
+            report("fdopen");
+            close(t->out);
+        } else {
+            t->status = builtins[t->b].fun(t->args);
+            out_close();
+        }
+        if (err != stderr) {
+            fclose(err);
+        }
+        // the streams closed their descriptors
+        t->out = t->err = -1;
+        task_release(t);
+        arena_reset();
+        // hand the task back to the shell
+        pthread_mutex_lock(&task_lock);
+        t->next = task_done;
+        __atomic_store_n(&task_done, t, __ATOMIC_RELAXED);
+        if (--task_pending == 0) {
+            pthread_cond_broadcast(&task_idle);
+        }
+        pthread_mutex_unlock(&task_lock);
+        uint64_t one = 1;
+        if (task_event >= 0 && write(task_event, &one, sizeof(one)) < 0) {
+            report("write");
+        }
+    }
+    return NULL;
+}
+//-----------------------------------------------------------------------------------
+// Wait until every queued builtin has finished
+//-----------------------------------------------------------------------------------
+void tasks_wait() {
+    pthread_mutex_lock(&task_lock);
+    while (task_pending > 0) {
+        pthread_cond_wait(&task_idle, &task_lock);
+    }
+    pthread_mutex_unlock(&task_lock);
+    tasks_reap();
+}
+//-----------------------------------------------------------------------------------
+// A forked child has no workers, so it must not wait for them
+//-----------------------------------------------------------------------------------
+void tasks_forget() {
+    pthread_mutex_init(&task_lock, NULL);
+    task_head = task_tail = task_done = NULL;
+    task_pending = 0;
+    worker_count = 0;
+}
+//-----------------------------------------------------------------------------------
+// Release the builtins the workers have finished
+//-----------------------------------------------------------------------------------
+void tasks_reap() {
+    struct task *t, *next;
+    struct job *job;
+    pthread_mutex_lock(&task_lock);
+    t = task_done;
+    task_done = NULL;
+    pthread_mutex_unlock(&task_lock);
+    for (; t != NULL; t = next) {
+        next = t->next;
+        if ((job = job_by_id(t->job)) != NULL) {
+            job_finish(job, t->status);
+        }
+        free(t);
+    }
+}
+//-----------------------------------------------------------------------------------
+// Close the descriptors a task still holds and free its directory's path
+//-----------------------------------------------------------------------------------
+void task_release(struct task *t) {
+    int *fds[] = {&t->in, &t->out, &t->err, &t->cwdfd}, j;
+    for (j = 0; j < 4; j++) {
+        if (*fds[j] >= 0) {
+            close(*fds[j]);
+            *fds[j] = -1;
+        }
+    }
+    free(t->cwd);
+    t->cwd = NULL;
+}
+//-----------------------------------------------------------------------------------
+// Hash a command name (FNV-1a)
+//-----------------------------------------------------------------------------------
+unsigned hash_name(char *com) {
+    unsigned h = 2166136261u;
+    while (*com != '\0') {
+        h = (h ^ (unsigned char) *com++) * 16777619u;
+    }
+    return h % HASH_SIZE;
+}
+//-----------------------------------------------------------------------------------
+// Resolve a command to its absolute path, searching PATH only on the first use
+//-----------------------------------------------------------------------------------
+char *hash_lookup(char *com) {
+    // paths are used as they are
+    if (strchr(com, '/') != NULL) {
+        return com;
+    }
+    // a different PATH makes every cached path stale
+    char *path = getenv("PATH");
+    if (path == NULL) {
+        path = "/bin:/usr/bin";
+    }
+    if (hash_path == NULL || strcmp(hash_path, path) != 0) {
+        hash_clear();
+        if ((hash_path = strdup(path)) == NULL) {
+            report("strdup");
+        }
+    }
+    // cached
+    unsigned h = hash_name(com);
+    struct hash_entry *entry;
+    for (entry = hash_table[h]; entry != NULL; entry = entry->next) {
+        if (strcmp(entry->name, com) == 0) {
+            entry->hits++;
+            return entry->path;
+        }
+    }
+    // search the PATH directories in order, an empty one means the current directory
+    char file[PATH_MAX];
+    struct stat st;
+    size_t n = strlen(com);
+    char *dir = path, *end;
+    while (1) {
+        end = strchrnul(dir, ':');
+        size_t len = end - dir;
+        if (len == 0) {
+            memcpy(file, ".", 1);
+            len = 1;
+        } else if (len + n + 2 <= sizeof(file)) {
+            memcpy(file, dir, len);
+        } else {
+            len = 0;
+        }
+        if (len > 0) {
+            file[len] = '/';
+            memcpy(file + len + 1, com, n + 1);
+            if (fstatat(cwdfd, file, &st, 0) == 0 && S_ISREG(st.st_mode) && faccessat(cwdfd, file, X_OK, 0) == 0) {
+                break;
+            }
+        }
+        if (*end == '\0') {
+            return NULL;
+        }
+        dir = end + 1;
+    }
+    // remember it
+    if ((entry = (struct hash_entry *) malloc(sizeof(struct hash_entry))) == NULL) {
+        report("malloc");
+        return NULL;
+    }
+    entry->name = strdup(com);
+    entry->path = strdup(file);
+    if (entry->name == NULL || entry->path == NULL) {
+        report("strdup");
+        free(entry->name);
+        free(entry->path);
+        free(entry);
+        return NULL;
+    }
+    entry->hits = 1;
+    entry->next = hash_table[h];
+    hash_table[h] = entry;
+    return entry->path;
+}
+//-----------------------------------------------------------------------------------
+// Copy the path of a command out of the cache, after forgetting a stale one;
+// 0 or ENOENT
+//-----------------------------------------------------------------------------------
+int hash_copy(char *com, char *path, int stale) {
+    pthread_mutex_lock(&hash_lock);
+    if (stale) {
+        hash_remove(com);
+    }
+    char *found = hash_lookup(com);
+    if (found != NULL) {
+        snprintf(path, PATH_MAX, "%s", found);
+    }
+    pthread_mutex_unlock(&hash_lock);
+    return found != NULL ? 0 : ENOENT;
+}
+//-----------------------------------------------------------------------------------
+// Forget the cached path of a command
+//-----------------------------------------------------------------------------------
+void hash_remove(char *com) {
+    struct hash_entry **link = &hash_table[hash_name(com)], *entry;
+    while ((entry = *link) != NULL) {
+        if (strcmp(entry->name, com) == 0) {
+            *link = entry->next;
+            free(entry->name);
+            free(entry->path);
+            free(entry);
+            return;
+        }
+        link = &entry->next;
+    }
+}
+//-----------------------------------------------------------------------------------
+// Forget all cached paths
+//-----------------------------------------------------------------------------------
+void hash_clear() {
+    int i;
+    struct hash_entry *entry, *next;
+    for (i = 0; i < HASH_SIZE; i++) {
+        for (entry = hash_table[i]; entry != NULL; entry = next) {
+            next = entry->next;
+            free(entry->name);
+            free(entry->path);
+            free(entry);
+        }
+        hash_table[i] = NULL;
+    }
+    free(hash_path);
+    hash_path = NULL;
+}
+//-----------------------------------------------------------------------------------
+// Print, fill or clear the command path cache
+//-----------------------------------------------------------------------------------
+int fun_hash(int args) {
+    int i;
+    // list the cache
+    int stat = 0;
+    pthread_mutex_lock(&hash_lock);
+    if (args == 0) {
+        struct hash_entry *entry;
+        fprintf(out, "hits\tcommand\n");
+        for (i = 0; i < HASH_SIZE; i++) {
+            for (entry = hash_table[i]; entry != NULL; entry = entry->next) {
+                fprintf(out, "%4d\t%s\n", entry->hits, entry->path);
+            }
+        }
+    // clear the cache
+    } else if (strcmp(tokens[1], "-r") == 0) {
+        hash_clear();
+    // look up the given commands
+    } else {
+        for (i = 1; i <= args; i++) {
+            if (hash_lookup(tokens[i]) == NULL) {
+                fprintf(err, "hash: %s: not found\n", tokens[i]);
+                stat = 1;
+            }
+        }
+    }
+    pthread_mutex_unlock(&hash_lock);
+    return stat;
+}
+//-----------------------------------------------------------------------------------
+// Start an external command with posix_spawn, which vforks instead of copying the
+// shell's page tables; fdin/fdout (or -1) become the child's standard descriptors
+//-----------------------------------------------------------------------------------
+pid_t spawn(char **argv, int fdin, int fdout, struct redirect *r, int n) {
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    sigset_t mask;
+    pid_t pid;
+    int e, j, held = 0, *captures = NULL;
+    if ((e = posix_spawn_file_actions_init(&actions)) != 0) {
+        errno = e;
+        report("posix_spawn_file_actions_init");
+        return -1;
+    }
+    // the shell may have SIGCHLD blocked, the command must not inherit that
+    sigemptyset(&mask);
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setsigmask(&attr, &mask);
+    // nor the ignored SIGPIPE
+    sigaddset(&mask, SIGPIPE);
+    posix_spawnattr_setsigdefault(&attr, &mask);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
+    // what isn't given comes from the thread's own descriptors, a session's or the shell's
+    if (fdin < 0) {
+        fdin = in;
+    }
+    if (fdout < 0) {
+        fdout = fileno(out);
+    }
+    // a command that may read the script's input gets it from the line after its own;
+    // from a pipe, it gets what the shell hasn't read ahead
+    for (j = 0; j < n && r[j].fd != 0; j++) {
+    }
+    if (j == n) {
+        input_claim(fdin);
+    }
+    out_flush();
+    fflush(err);
+    if (fdin >= 0 && fdin != 0) {
+        posix_spawn_file_actions_adddup2(&actions, fdin, 0);
+    }
+    if (fdout >= 0 && fdout != 1) {
+        posix_spawn_file_actions_adddup2(&actions, fdout, 1);
+    }
+    if (fileno(err) != 2) {
+        posix_spawn_file_actions_adddup2(&actions, fileno(err), 2);
+    }
+    if (cwdfd != AT_FDCWD) {
+        posix_spawn_file_actions_addfchdir_np(&actions, cwdfd);
+    }
+    // the command's own redirections, in order; the child opens the files relative to
+    // the directory it has just moved to, only captures are the shell's to open
+    for (j = 0, e = 0; j < n && e == 0; j++) {
+        if (r[j].path == NULL) {
+            e = posix_spawn_file_actions_adddup2(&actions, r[j].dup, r[j].fd);
+        } else if (r[j].flags == O_RDONLY && r[j].path[0] == '@') {
+            if (captures == NULL) {
+                captures = (int *) arena_alloc(n * sizeof(int));
+            }
+            if ((captures[held] = capture_open(&r[j].path[1])) < 0) {
+                break;
+            }
+            e = posix_spawn_file_actions_adddup2(&actions, captures[held++], r[j].fd);
+        } else {
+            e = posix_spawn_file_actions_addopen(&actions, r[j].fd, r[j].path, r[j].flags, 0666);
+        }
+    }
+    uint64_t t = trace_start();
+    char path[PATH_MAX];
+    int found = hash_copy(argv[0], path, 0) == 0;
+    if (j < n || e != 0) {
+        found = 0;
+    } else {
+        e = !found ? ENOENT : spawn_exec(&pid, path, &actions, &attr, argv, fdin, fdout, n);
+    }
+    // a command that vanished from its cached path is looked up once more; a missing
+    // file of a redirection is no reason to
+    if (e == ENOENT && found && strchr(argv[0], '/') == NULL && faccessat(cwdfd, path, X_OK, 0) < 0
+            && hash_copy(argv[0], path, 1) == 0) {
+        e = spawn_exec(&pid, path, &actions, &attr, argv, fdin, fdout, n);
+    }
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+    while (held > 0) {
+        close(captures[--held]);
+    }
+    if (j < n) {
+        return -1;
+    }
+    if (e != 0) {
+        errno = e;
+        if (n == 0 || spawn_blame(r, n) == 0) {
+            report("spawn");
+        }
+        return -1;
+    }
+    trace_end(T_EXEC, argv[0], t);
+    stat_add(&stats.spawns, 1);
+    return pid;
+}
+//-----------------------------------------------------------------------------------
+// After a failed spawn, find the redirection whose file the child could not open by
+// opening them again in the same order, and report it by name; 0 if they all open.
+// The ones before it the child has opened already, so this changes nothing
+//-----------------------------------------------------------------------------------
+int spawn_blame(struct redirect *r, int n) {
+    int j, fd;
+    for (j = 0; j < n; j++) {
+        if (r[j].path == NULL || (r[j].flags == O_RDONLY && r[j].path[0] == '@')) {
+            continue;
+        }
+        if ((fd = openat(cwdfd, r[j].path, r[j].flags | O_CLOEXEC, 0666)) < 0) {
+            report(r[j].path);
+            return 1;
+        }
+        close(fd);
+    }
+    return 0;
+}
+//-----------------------------------------------------------------------------------
+// Start a command through the zygote when there is one that takes it, with
+// posix_spawn otherwise; 0 or an error number, like posix_spawn. The zygote gets
+// the three descriptors as they are, commands with redirections of their own don't
+// go there
+//-----------------------------------------------------------------------------------
+int spawn_exec(pid_t *pid, char *path, posix_spawn_file_actions_t *actions, posix_spawnattr_t *attr,
+        char **argv, int fdin, int fdout, int redirected) {
+    int e;
+    if (zygote >= 0 && redirected == 0 && (e = zygote_spawn(pid, path, argv, fdin, fdout)) >= 0) {
+        return e;
+    }
+    return posix_spawn(pid, path, actions, attr, argv, environ);
+}
+//-----------------------------------------------------------------------------------
+// Execute external command in foreground
+//-----------------------------------------------------------------------------------
+void fun_exec_front(int args, struct redirect *r, int n) {
+    tokens[args+1] = NULL;
+    int pid = spawn(tokens, -1, -1, r, n);
+    // error
+    if (pid < 0) {
+        status = EXIT_FAILURE;
+    // wait until the child exits
+    } else {
+        int stat;
+        uint64_t t = trace_start();
+        if (waitpid(pid, &stat, 0) < 0) {
+            report("waitpid");
+        } else {
+            status = exit_status(stat);
+        }
+        trace_end(T_WAIT, tokens[0], t);
+    }
+}
+//-----------------------------------------------------------------------------------
+// Execute external command in background
+//-----------------------------------------------------------------------------------
+void fun_exec_back(int args, struct redirect *r, int n) {
+    tokens[args+1] = NULL;
+    int pid = spawn(tokens, -1, -1, r, n);
+    if (pid > 0) {
+        job_add(pid, args);
+    }
+}
+//-----------------------------------------------------------------------------------
+// Call internal function in pipeline
+//-----------------------------------------------------------------------------------
+int fun_exec_internal(int index) {
+    tokens = split[index];
+    int b = find_builtin(tokens[0]);
+    if (count[index] < builtins[b].args) {
+        fprintf(err, "%s: missing operand\n", builtins[b].name);
+        return EXIT_FAILURE;
+    }
+    return builtins[b].fun(count[index]);
+}
+//-----------------------------------------------------------------------------------
+// Exit status of a waited child, like the shells report it
+//-----------------------------------------------------------------------------------
+int exit_status(int stat) {
+    if (WIFSIGNALED(stat)) {
+        return 128 + WTERMSIG(stat);
+    }
+    return WEXITSTATUS(stat);
+}
+//-----------------------------------------------------------------------------------
+// Print what failed and why, like perror, on the error stream of this thread
+//-----------------------------------------------------------------------------------
+void report(char *what) {
+    fprintf(err != NULL ? err : stderr, "%s: %s\n", what, strerror(errno));
+}
+//-----------------------------------------------------------------------------------
+// End a forked child; a server's child has copies of every session's streams, so
+// only its own are flushed
+//-----------------------------------------------------------------------------------
+void child_exit(int stat) {
+    if (serve_epoll < 0) {
+        exit(stat);
+    }
+    out_flush();
+    fflush(err);
+    _exit(stat);
+}
+//-----------------------------------------------------------------------------------
+// Add a background job running the command in tokens[0..args]
+//-----------------------------------------------------------------------------------
+struct job *job_add(pid_t pid, int args) {
+    int i;
+    size_t size = 0;
+    for (i = 0; i <= args; i++) {
+        size += strlen(tokens[i]) + 1;
+    }
+    struct job *j = (struct job *) malloc(sizeof(struct job) + size);
+    if (j == NULL) {
+        report("malloc");
+        return NULL;
+    }
+    // keep the command line for jobs and fg
+    j->cmd = (char *) (j + 1);
+    char *p = j->cmd;
+    for (i = 0; i <= args; i++) {
+        size = strlen(tokens[i]);
+        memcpy(p, tokens[i], size);
+        p += size;
+        *p++ = i < args ? ' ' : '\0';
+    }
+    j->id = job_last != NULL ? job_last->id + 1 : 1;
+    j->pid = pid;
+    j->type = find_builtin(tokens[0]);
+    j->done = 0;
+    j->status = 0;
+    clock_gettime(CLOCK_MONOTONIC, &j->start);
+    // append it to the table
+    j->next = NULL;
+    j->prev = job_last;
+    if (job_last != NULL) {
+        job_last->next = j;
+    } else {
+        job_first = j;
+    }
+    job_last = j;
+    // processes can be found by their pid when they are reaped
+    if (pid > 0) {
+        j->hash = job_pids[pid % JOB_BUCKETS];
+        job_pids[pid % JOB_BUCKETS] = j;
+    }
+    job_running++;
+    return j;
+}
+//-----------------------------------------------------------------------------------
+// Find a job by its number
+//-----------------------------------------------------------------------------------
+struct job *job_by_id(int id) {
+    struct job *j;
+    for (j = job_last; j != NULL && j->id >= id; j = j->prev) {
+        if (j->id == id) {
+            return j;
+        }
+    }
+    return NULL;
+}
+//-----------------------------------------------------------------------------------
+// Find a job given as %n or n
+//-----------------------------------------------------------------------------------
+struct job *job_find(char *spec) {
+    char *end;
+    if (*spec == '%') {
+        spec++;
+    }
+    long id = strtol(spec, &end, 10);
+    if (*spec == '\0' || *end != '\0' || id <= 0 || id > INT_MAX) {
+        return NULL;
+    }
+    return job_by_id((int) id);
+}
+//-----------------------------------------------------------------------------------
+// Record the end of a job
+//-----------------------------------------------------------------------------------
+void job_finish(struct job *j, int stat) {
+    // it can't be reaped a second time
+    if (j->pid > 0) {
+        struct job **link = &job_pids[j->pid % JOB_BUCKETS];
+        while (*link != j) {
+            link = &(*link)->hash;
+        }
+        *link = j->hash;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &j->end);
+    stat_command(j->type, &j->start, &j->end);
+    j->done = 1;
+    j->status = stat;
+    job_running--;
+    job_finished++;
+}
+//-----------------------------------------------------------------------------------
+// Remove a finished job from the table
+//-----------------------------------------------------------------------------------
+void job_remove(struct job *j) {
+    if (j->prev != NULL) {
+        j->prev->next = j->next;
+    } else {
+        job_first = j->next;
+    }
+    if (j->next != NULL) {
+        j->next->prev = j->prev;
+    } else {
+        job_last = j->prev;
+    }
+    job_finished--;
+    free(j);
+}
+//-----------------------------------------------------------------------------------
+// Collect the children and builtins that have finished
+//-----------------------------------------------------------------------------------
+void jobs_reap() {
+    struct signalfd_siginfo info;
+    struct job *j, *next;
+    uint64_t n;
+    pid_t pid;
+    int stat;
+    // children are only looked for when one of them has exited
+    if (read(sigfd, &info, sizeof(info)) > 0) {
+        while (read(sigfd, &info, sizeof(info)) > 0) { }
+        while ((pid = waitpid(-1, &stat, WNOHANG)) > 0) {
+            for (j = job_pids[pid % JOB_BUCKETS]; j != NULL && j->pid != pid; j = j->hash) { }
+            if (j != NULL) {
+                trace_end(T_REAP, j->cmd, trace_start());
+                job_finish(j, exit_status(stat));
+            }
+        }
+    }
+    // builtins from the worker pool
+    if (task_event >= 0 && read(task_event, &n, sizeof(n)) < 0 && errno != EAGAIN) {
+        report("read");
+    }
+    if (__atomic_load_n(&task_done, __ATOMIC_RELAXED) != NULL) {
+        tasks_reap();
+    }
+    // a script rarely asks about old jobs, so don't let them pile up
+    for (j = job_first; !interactive && job_finished > JOB_KEEP && j != NULL; j = next) {
+        next = j->next;
+        if (j->done) {
+            job_remove(j);
+        }
+    }
+}
+//-----------------------------------------------------------------------------------
+// Wait until fd has input, reaping the jobs that finish in the meantime
+//-----------------------------------------------------------------------------------
+void jobs_poll(int fd) {
+    struct pollfd fds[3] = {{fd, POLLIN, 0}, {sigfd, POLLIN, 0}, {task_event, POLLIN, 0}};
+    while (job_running > 0) {
+        if (poll(fds, task_event >= 0 ? 3 : 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            report("poll");
+            return;
+        }
+        if (fds[1].revents != 0 || (task_event >= 0 && fds[2].revents != 0)) {
+            jobs_reap();
+        }
+        if (fds[0].revents != 0) {
+            return;
+        }
+    }
+}
+//-----------------------------------------------------------------------------------
+// Tell the user which jobs have finished since the last prompt
+//-----------------------------------------------------------------------------------
+void jobs_notify() {
+    struct job *j, *next;
+    for (j = job_first; job_finished > 0 && j != NULL; j = next) {
+        next = j->next;
+        if (j->done) {
+            if (j->status == 0) {
+                printf("[%d]  Done      %s\n", j->id, j->cmd);
+            } else {
+                printf("[%d]  Exit %-4d %s\n", j->id, j->status, j->cmd);
+            }
+            job_remove(j);
+        }
+    }
+}
+//-----------------------------------------------------------------------------------
+// Wait until a job has finished and return its status
+//-----------------------------------------------------------------------------------
+int job_wait(struct job *j) {
+    struct pollfd fds[2] = {{sigfd, POLLIN, 0}, {task_event, POLLIN, 0}};
+    uint64_t t = trace_start();
+    while (1) {
+        jobs_reap();
+        if (j->done) {
+            trace_end(T_WAIT, j->cmd, t);
+            return j->status;
+        }
+        if (poll(fds, task_event >= 0 ? 2 : 1, -1) < 0 && errno != EINTR) {
+            report("poll");
+            return EXIT_FAILURE;
+        }
+    }
+}
+//-----------------------------------------------------------------------------------
+// List the jobs, forgetting the finished ones once they have been shown
+//-----------------------------------------------------------------------------------
+int fun_jobs(int args) {
+    struct job *j, *next;
+    struct timespec now, *end;
+    double elapsed;
+    jobs_reap();
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    for (j = job_first; j != NULL; j = next) {
+        next = j->next;
+        end = j->done ? &j->end : &now;
+        elapsed = (end->tv_sec - j->start.tv_sec) + (end->tv_nsec - j->start.tv_nsec) / 1e9;
+        fprintf(out, "[%d]  %7d  ", j->id, (int) j->pid);
+        if (!j->done) {
+            fprintf(out, "Running  ");
+        } else if (j->status == 0) {
+            fprintf(out, "Done     ");
+        } else {
+            fprintf(out, "Exit %-4d", j->status);
+        }
+        fprintf(out, "%9.3fs  %s\n", elapsed, j->cmd);
+        if (j->done) {
+            job_remove(j);
+        }
+    }
+    return 0;
+}
+//-----------------------------------------------------------------------------------
+// Wait for every job, or for the given ones and return the status of the last
+//-----------------------------------------------------------------------------------
+int fun_wait(int args) {
+    struct job *j;
+    int i, stat = 0;
+    if (args == 0) {
+        while ((j = job_first) != NULL) {
+            job_wait(j);
+            job_remove(j);
+        }
+        return 0;
+    }
+    for (i = 1; i <= args; i++) {
+        if ((j = job_find(tokens[i])) == NULL) {
+            fprintf(err, "wait: %s: no such job\n", tokens[i]);
+            stat = 127;
+        } else {
+            stat = job_wait(j);
+            job_remove(j);
+        }
+    }
+    return stat;
+}
+//-----------------------------------------------------------------------------------
+// Bring the last or the given job to the foreground and wait for it
+//-----------------------------------------------------------------------------------
+int fun_fg(int args) {
+    struct job *j = job_last;
+    if (args == 1) {
+        j = job_find(tokens[1]);
+    }
+    if (j == NULL && args == 1) {
+        fprintf(err, "fg: %s: no such job\n", tokens[1]);
+        return EXIT_FAILURE;
+    } else if (j == NULL) {
+        fprintf(err, "fg: no current job\n");
+        return EXIT_FAILURE;
+    }
+    fprintf(out, "%s\n", j->cmd);
+    out_flush();
+    int stat = job_wait(j);
+    job_remove(j);
+    return stat;
+}
+//-----------------------------------------------------------------------------------
+// Run the command lines of a file (or the input) with at most -j of them at once;
+// the output of each one is held in a memfd and written out in input order
+//-----------------------------------------------------------------------------------
+int fun_parallel(int args) {
+    long jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    char *file = NULL, *end;
+    int i;
+    // parse the options
+    for (i = 1; i <= args; i++) {
+        if (strncmp(tokens[i], "-j", 2) == 0) {
+            char *n = tokens[i][2] != '\0' ? &tokens[i][2] : i < args ? tokens[++i] : "";
+            jobs = strtol(n, &end, 10);
+            if (*n == '\0' || *end != '\0' || jobs <= 0 || jobs > 4096) {
+                fprintf(err, "parallel: invalid job count: %s\n", n);
+                return EXIT_FAILURE;
+            }
+        } else if (file == NULL) {
+            file = tokens[i];
+        } else {
+            fprintf(err, "usage: parallel [-j N] [file]\n");
+            return EXIT_FAILURE;
+        }
+    }
+    if (jobs <= 0) {
+        jobs = 1;
+    }
+    // the command lines must not read what is meant for parallel
+    int fdin = in, null;
+    if ((null = open("/dev/null", O_RDONLY | O_CLOEXEC)) < 0) {
+        report("open");
+        return EXIT_FAILURE;
+    }
+    if (file != NULL && strcmp(file, "-") != 0 && (fdin = openat(cwdfd, file, O_RDONLY | O_CLOEXEC)) < 0) {
+        report("open");
+        close(null);
+        return EXIT_FAILURE;
+    }
+    if (fdin == in && input_claim(fdin) < 0) {
+        fprintf(err, "parallel: standard input holds the script\n");
+        close(null);
+        return EXIT_FAILURE;
+    }
+    // a ring of commands in input order: the running ones and those waiting to be written
+    int size = (int) jobs * PARALLEL_WINDOW;
+    struct batch *ring = (struct batch *) malloc(size * sizeof(struct batch));
+    struct pollfd *fds = (struct pollfd *) arena_alloc(size * sizeof(struct pollfd));
+    if (ring == NULL) {
+        report("malloc");
+        if (fdin != in) {
+            close(fdin);
+        }
+        close(null);
+        return EXIT_FAILURE;
+    }
+    struct reader r;
+    reader_init(&r, fdin);
+    // the lines are parsed like the shell's own, parallel's redirections are put back
+    char **saved = tokens, *saved_literal = literal;
+    struct redirect *saved_redirects = redirects;
+    int saved_count = token_count, saved_redirect_count = redirect_count, *saved_opt = opt;
+    int head = 0, tail = 0, running = 0, total = 0, failed = 0, eof = 0, last = -1;
+    struct arena_block *mark;
+    size_t used;
+    char *line;
+    size_t len;
+    out_flush();
+    while (!eof || head != tail) {
+        // start commands while there is room in the ring and the limit allows it
+        while (!eof && running < jobs && tail - head < size) {
+            if ((line = read_line(&r, &len)) == NULL) {
+                eof = 1;
+                break;
+            }
+            mark = arena_mark(&used);
+            // a trailing & is ignored, the lines run side by side anyway; a line of
+            // nothing but redirections is skipped, like in the shell
+            if (len > 1 && tokenize(line, len) && ((last = parse()) >= 0 || token_count > 0)) {
+                struct batch *b = &ring[tail % size];
+                if (last < 0) {
+                    b->out = -1;
+                    b->done = 1;
+                    b->status = EXIT_FAILURE;
+                } else if (batch_start(b, null, last) > 0) {
+                    running++;
+                } else {
+                    b->done = 1;
+                    b->status = EXIT_FAILURE;
+                }
+                tail++;
+                total++;
+            }
+            arena_release(mark, used);
+        }
+        // write out the finished commands at the front of the ring
+        while (head != tail && ring[head % size].done) {
+            struct batch *b = &ring[head % size];
+            if (b->out >= 0) {
+                if (lseek(b->out, 0, SEEK_SET) < 0) {
+                    report("lseek");
+                } else {
+                    copy_fd(b->out, fileno(out));
+                }
+                close(b->out);
+            }
+            if (b->status != 0) {
+                failed++;
+            }
+            head++;
+        }
+        // wait for any of the running commands
+        if (running > 0) {
+            running -= batch_wait(ring, fds, size, head, tail);
+        }
+    }
+    tokens = saved;
+    token_count = saved_count;
+    literal = saved_literal;
+    redirects = saved_redirects;
+    redirect_count = saved_redirect_count;
+    opt = saved_opt;
+    free(r.buf);
+    free(ring);
+    if (fdin != in) {
+        close(fdin);
+    }
+    close(null);
+    if (failed > 0) {
+        fprintf(err, "parallel: %d of %d commands failed\n", failed, total);
+    }
+    return failed < 100 ? failed : 100;
+}
+//-----------------------------------------------------------------------------------
+// Start the command in tokens[0..args], as parsed, with its output going to a fresh
+// memfd
+//-----------------------------------------------------------------------------------
+pid_t batch_start(struct batch *b, int fdin, int args) {
+    b->pid = -1;
+    b->pidfd = -1;
+    b->done = 0;
+    b->status = 0;
+    if ((b->out = memfd_create("parallel", MFD_CLOEXEC)) < 0) {
+        report("memfd_create");
+        return -1;
+    }
+    int c = find_builtin(tokens[0]);
+    if (c < 0) {
+        b->pid = spawn(tokens, fdin, b->out, redirects, redirect_count);
+    // builtins get a process of their own, like in a background job
+    } else if (args < builtins[c].args) {
+        fprintf(err, "%s: missing operand\n", builtins[c].name);
+    } else if ((b->pid = fork()) < 0) {
+        report("fork");
+    } else if (b->pid > 0) {
+        stat_add(&stats.forks, 1);
+    } else {
+        if (dup2(fdin, 0) < 0 || dup2(b->out, 1) < 0) {
+            report("dup2");
+            exit(EXIT_FAILURE);
+        }
+        in = 0;
+        out = stdout;
+        input_shared = 0;
+        // the process is the command's own: its redirections take the descriptors
+        // themselves, out of the way first so none is overwritten before it is copied
+        if (redirect_count > 0) {
+            int fds[3], j;
+            int *opened = (int *) arena_alloc(redirect_count * sizeof(int));
+            if (redirect_open(fds, opened) < 0) {
+                exit(EXIT_FAILURE);
+            }
+            for (j = 0; j < 3; j++) {
+                if (fds[j] != j && fds[j] < 3 && (fds[j] = fcntl(fds[j], F_DUPFD_CLOEXEC, 3)) < 0) {
+                    report("fcntl");
+                    exit(EXIT_FAILURE);
                 }
             }
-            // a command was entered
-            if (strlen(line) > 1) {
-                // get command data and execute it if it satifies conditions
-                if (tokenize(line)) {
-                    eval();
+            fflush(err);
+            for (j = 0; j < 3; j++) {
+                if (fds[j] != j && dup2(fds[j], j) < 0) {
+                    report("dup2");
+                    exit(EXIT_FAILURE);
                 }
             }
+            err = stderr;
         }
+        child_exit(builtins[c].fun(args));
     }
-    // end of shell
-    exit(0);
+    // without pidfds the commands are waited for in order
+    if (b->pid > 0 && (b->pidfd = pidfd_open(b->pid, 0)) < 0 && errno != ENOSYS) {
+        report("pidfd_open");
+    }
+    return b->pid;
 }
-//--------------------------------------------------------------------------------------
-// Line reading and detection of symbols
-//--------------------------------------------------------------------------------------
-int tokenize(char *line) {
-    char *p = line;
-    int i = 0, quote;
-    tokens = NULL;
-    token_count = 0;
-    // move to the first non-whitespace character
-    while (isspace(*p)) {
-        // check if they're all equal to spaces
-        if (*(p++) == '\n') {
-            return 0;
+//-----------------------------------------------------------------------------------
+// Wait until some running commands of the ring have exited and return how many did
+//-----------------------------------------------------------------------------------
+int batch_wait(struct batch *ring, struct pollfd *fds, int size, int head, int tail) {
+    struct batch *b;
+    int i, n = 0, nfds = 0, stat;
+    for (i = head; i < tail; i++) {
+        b = &ring[i % size];
+        if (b->done) {
+            continue;
+        }
+        // no pidfd: block on this one
+        if (b->pidfd < 0) {
+            if (waitpid(b->pid, &stat, 0) < 0) {
+                report("waitpid");
+                stat = EXIT_FAILURE << 8;
+            }
+            b->status = exit_status(stat);
+            b->done = 1;
+            return 1;
         }
+        fds[nfds].fd = b->pidfd;
+        fds[nfds].events = POLLIN;
+        nfds++;
     }
-    // check if it's a comment
-    if (*p == '#') {
+    if (poll(fds, nfds, -1) < 0) {
+        if (errno != EINTR) {
+            report("poll");
+        }
         return 0;
     }
-    // parse the line
-    while (i == 0) {
-        // check for quotes
-        quote = 0;
-        if (*p == '"') {
-            quote = 1;
-            p++;
+    // the ones whose pidfd is readable have exited
+    for (i = head, nfds = 0; i < tail; i++) {
+        b = &ring[i % size];
+        if (b->done) {
+            continue;
         }
-        // start of the symbol
-        tokens = (char **) realloc(tokens, (token_count+1) * sizeof(char *));
-        tokens[token_count++] = p;
-        while (1) {
-            // symbol in quotes
-            if (quote == 1 && *p == '"') {
-                *(p++) = '\0';
-                // end of the line
-                if (*(p++) == '\n' || *(p+1) == '\n') {
-                    i = 1;
-                }
-                break;
-            }
-            // regular symbol
-            else if (quote == 0 && isspace(*p)) {
-                // end of the line
-                if (*p == '\n' || *(p+1) == '\n') {
-                    i = 1;
-                }
-                *p = '\0';
-                p++;
-                break;
+        if (fds[nfds++].revents != 0) {
+            if (waitpid(b->pid, &stat, 0) < 0) {
+                report("waitpid");
+                stat = EXIT_FAILURE << 8;
             }
-            // new character
-            p++;
+            close(b->pidfd);
+            b->status = exit_status(stat);
+            b->done = 1;
+            n++;
         }
     }
-    return 1;
+    return n;
 }
-//--------------------------------------------------------------------------------------
-// Command execution
-//--------------------------------------------------------------------------------------
-void eval() {
-    int i = token_count-1;
-    opt = (int *) calloc(3, sizeof(int));
-    // process in background
-    if (strcmp(tokens[i], "&") == 0) {
-        opt[2] = 1;
-        i--;
+//-----------------------------------------------------------------------------------
+// Run a script file from a read-only mapping, each line tokenized in a copy in the
+// arena; -1 means it can't be mapped and nothing has been run
+//-----------------------------------------------------------------------------------
+int script_run(int fd) {
+    struct stat st;
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+        return -1;
     }
-    // save the descriptor state
-    int j, fd[2];
-    for (j = 0; j < 2; j++) {
-        if ((fd[j] = dup(j)) < 0) {
-            perror("dup");
-        }
+    char *script = (char *) mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (script == MAP_FAILED) {
+        report("mmap");
+        return -1;
     }
-    // redirection of output
-    if (tokens[i][0] == '>') {
-        opt[1] = 1;
-        int fdout;
-        if ((fdout = open(&tokens[i--][1], O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0) {
-            perror("open");
-        } else if (dup2(fdout, 1) < 0) {
-            perror("dup2");
+    madvise(script, st.st_size, MADV_SEQUENTIAL);
+    char *p = script, *end = script + st.st_size, *nl, *line;
+    size_t len, dropped = 0, page = getpagesize();
+    while (p < end) {
+        if ((nl = memchr(p, '\n', end - p)) == NULL) {
+            nl = end;
+        }
+        // tokenize works on a copy that ends in a newline, like from read_line
+        len = nl - p;
+        line = (char *) arena_alloc(len + 2);
+        memcpy(line, p, len);
+        line[len++] = '\n';
+        line[len] = '\0';
+        p = nl + 1;
+        if (len > 1) {
+            uint64_t t = trace_start();
+            int ok = tokenize(line, len);
+            trace_end(T_TOKENIZE, "line", t);
+            if (ok) {
+                eval();
+            }
+        }
+        arena_reset();
+        // collect the background jobs that have finished
+        if (job_running > 0) {
+            jobs_reap();
         }
+        // the lines that have run are not needed again
+        if (p - script - dropped >= SCRIPT_DROP && p < end) {
+            size_t upto = (p - script) & ~(page - 1);
+            madvise(script + dropped, upto - dropped, MADV_DONTNEED);
+            dropped = upto;
+        }
+    }
+    munmap(script, st.st_size);
+    return 0;
+}
+//-----------------------------------------------------------------------------------
+// FNV-1a over the whole script
+//-----------------------------------------------------------------------------------
+uint64_t cache_hash(char *data, size_t size) {
+    uint64_t h = 14695981039346656037ULL;
+    size_t i;
+    for (i = 0; i < size; i++) {
+        h = (h ^ (unsigned char) data[i]) * 1099511628211ULL;
+    }
+    return h;
+}
+//-----------------------------------------------------------------------------------
+// Run a script file through the cache, compiling it first when it changed;
+// -1 means it can't be cached and nothing has been run
+//-----------------------------------------------------------------------------------
+int cache_script(int fd) {
+    struct stat st;
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+        return -1;
     }
-    // redirection of input
-    if (tokens[i][0] == '<') {
-        opt[0] = 1;
-        int fdin;
-        if ((fdin = open(&tokens[i--][1], O_RDONLY)) < 0) {
-            perror("open");
-        } else if (dup2(fdin, 0) < 0) {
-            perror("dup2");
+    char *script = (char *) mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (script == MAP_FAILED) {
+        report("mmap");
+        return -1;
+    }
+    madvise(script, st.st_size, MADV_SEQUENTIAL);
+    uint64_t hash = cache_hash(script, st.st_size);
+    size_t size;
+    char *image = cache_load(cache_dir, hash, st.st_size, &size);
+    if (image != NULL) {
+        munmap(script, st.st_size);
+        // the commands see the script as read, like without the cache
+        lseek(fd, 0, SEEK_END);
+        if (fd == 0) {
+            input_shared = -1;
         }
+        cache_run(image);
+        munmap(image, size);
+        return 0;
     }
-    //-------------------------------------------------------------------------------
-    // INTERNAL COMMANDS
-    //-------------------------------------------------------------------------------
-    char *com = tokens[0];
-    // NAME
-    if (strcmp(com, "name") == 0) {
-        fun_name(i);
-    // HELP
-    } else if (strcmp(com, "help") == 0) {
-        fun_help();
-    // STATUS
-    } else if (strcmp(com, "status") == 0) {
-        fun_status();
-    // EXIT
-    } else if (strcmp(com, "exit") == 0) {
-        fun_exit(i);
-    // PRINT
-    } else if (strcmp(com, "print") == 0) {
-        fun_print(i);
-    // ECHO
-    } else if (strcmp(com, "echo") == 0) {
-        fun_echo(i);
-    // PID
-    } else if (strcmp(com, "pid") == 0) {
-        if (opt[2] == 0) {
-            fun_pid();
-        } else {
-            int pid = fork();
-            if (pid < 0) {
-                perror("fork");
-            } else if (pid == 0) {
-                fun_pid();
-                exit(0);
-            }
+    image = cache_compile(script, st.st_size, hash, &size);
+    munmap(script, st.st_size);
+    cache_save(cache_dir, image, size);
+    lseek(fd, 0, SEEK_END);
+    if (fd == 0) {
+        input_shared = -1;
+    }
+    cache_run(image);
+    free(image);
+    return 0;
+}
+//-----------------------------------------------------------------------------------
+// Tokenize and parse every line of a script into one image
+//-----------------------------------------------------------------------------------
+char *cache_compile(char *script, size_t size, uint64_t hash, size_t *length) {
+    size_t cap = sizeof(struct cache_header) + size * 2 + 4096, used = sizeof(struct cache_header);
+    char *image = (char *) malloc(cap), *p = script, *end = script + size, *nl, *line;
+    if (image == NULL) {
+        int e = errno;
+        report("malloc");
+        exit(e);
+    }
+    struct cache_header *h = (struct cache_header *) image;
+    memcpy(h->magic, CACHE_MAGIC, sizeof(h->magic));
+    h->hash = hash;
+    h->size = size;
+    h->builtins = B_COUNT;
+    h->commands = 0;
+    // what tokenize and parse report goes into the image, to be reported on every run
+    char *msg = NULL;
+    size_t msglen = 0, mark;
+    FILE *saved = err;
+    if ((err = open_memstream(&msg, &msglen)) == NULL) {
+        int e = errno;
+        err = saved;
+        report("open_memstream");
+        exit(e);
+    }
+    while (p < end) {
+        if ((nl = memchr(p, '\n', end - p)) == NULL) {
+            nl = end;
         }
-    // PPID
-    } else if (strcmp(com, "ppid") == 0) {
-        if (opt[2] == 0) {
-            fun_ppid();
-        } else {
-            int pid = fork();
-            if (pid < 0) {
-                perror("fork");
-            } else if (pid == 0) {
-                fun_ppid();
-                exit(0);
-            }
+        // tokenize works on a copy that ends in a newline, like from read_line
+        size_t len = nl - p;
+        line = (char *) arena_alloc(len + 2);
+        memcpy(line, p, len);
+        line[len++] = '\n';
+        line[len] = '\0';
+        p = nl + 1;
+        int i = -1, j, failed = status;
+        status = 0;
+        mark = msglen;
+        int ok = len > 1 && tokenize(line, len) && (i = parse()) >= 0;
+        fflush(err);
+        if (msglen > mark) {
+            char *text[] = {msg + mark, NULL}, **parsed = tokens;
+            int count = token_count;
+            tokens = text;
+            token_count = 1;
+            image = cache_add(image, &cap, &used, CACHE_ERROR, status != 0, 0);
+            tokens = parsed;
+            token_count = count;
         }
-    // DIR
-    } else if (strcmp(com, "dir") == 0) {
-        fun_dir(i);
-    // DIRWHERE
-    } else if (strcmp(com, "dirwhere") == 0) {
-        if (opt[2] == 0) {
-            fun_dirwhere();
-        } else {
-            int pid = fork();
-            if (pid < 0) {
-                perror("fork");
-            } else if (pid == 0) {
-                fun_dirwhere();
-                exit(0);
-            }
+        status = failed;
+        if (!ok) {
+            arena_reset();
+            continue;
         }
-    // DIRMAKE
-    } else if (strcmp(com, "dirmake") == 0) {
-        if (opt[2] == 0) {
-            fun_dirmake();
-        } else {
-            int pid = fork();
-            if (pid < 0) {
-                perror("fork");
-            } else if (pid == 0) {
-                fun_dirmake();
-                exit(0);
+        // the redirections become symbols after the arguments
+        for (j = 0; j < redirect_count; j++) {
+            struct redirect *r = &redirects[j];
+            char *how = (char *) arena_alloc((r->path != NULL ? strlen(r->path) : 1) + 3);
+            how[0] = '0' + r->fd;
+            if (r->path == NULL) {
+                how[1] = '&';
+                how[2] = '0' + r->dup;
+                how[3] = '\0';
+            } else {
+                how[1] = r->flags == O_RDONLY ? '<' : (r->flags & O_TRUNC) ? '>'
+                    : (r->flags & O_APPEND) ? '+' : '=';
+                strcpy(how + 2, r->path);
             }
+            tokens[token_count++] = how;
         }
-    // DIRREMOVE
-    } else if (strcmp(com, "dirremove") == 0) {
-        if (opt[2] == 0) {
-            fun_dirremove();
-        } else {
-            int pid = fork();
-            if (pid < 0) {
-                perror("fork");
-            } else if (pid == 0) {
-                fun_dirremove();
-                exit(0);
-            }
+        image = cache_add(image, &cap, &used, find_builtin(tokens[0]), opt[0] | opt[1] << 1 | opt[2] << 2, i);
+        arena_reset();
+    }
+    fclose(err);
+    free(msg);
+    err = saved;
+    *length = used;
+    return image;
+}
+//-----------------------------------------------------------------------------------
+// Append the command in tokens to the image, growing it when needed
+//-----------------------------------------------------------------------------------
+char *cache_add(char *image, size_t *cap, size_t *used, int b, int flags, int args) {
+    int j;
+    // size of the record with its tokens
+    size_t need = sizeof(struct cache_command) + token_count * sizeof(uint32_t);
+    for (j = 0; j < token_count; j++) {
+        need += strlen(tokens[j]) + 1;
+    }
+    need = (need + 7) & ~(size_t) 7;
+    while (*used + need > *cap) {
+        *cap *= 2;
+        if ((image = (char *) realloc(image, *cap)) == NULL) {
+            int e = errno;
+            report("realloc");
+            exit(e);
         }
-    // DIRLIST
-    } else if (strcmp(com, "dirlist") == 0) {
-        if (opt[2] == 0) {
-            fun_dirlist(i);
-        } else {
-            int pid = fork();
-            if (pid < 0) {
-                perror("fork");
-            } else if (pid == 0) {
-                fun_dirlist(i);
-                exit(0);
+    }
+    struct cache_command *c = (struct cache_command *) (image + *used);
+    memset(c, 0, need);
+    c->size = need;
+    c->b = b;
+    c->opt = flags;
+    c->args = args;
+    c->count = token_count;
+    size_t off = sizeof(struct cache_command) + token_count * sizeof(uint32_t);
+    for (j = 0; j < token_count; j++) {
+        c->offset[j] = off;
+        strcpy((char *) c + off, tokens[j]);
+        off += strlen(tokens[j]) + 1;
+    }
+    *used += need;
+    ((struct cache_header *) image)->commands++;
+    return image;
+}
+//-----------------------------------------------------------------------------------
+// Path of the cache file of a script
+//-----------------------------------------------------------------------------------
+void cache_path(char *path, size_t size, char *dir, uint64_t hash, char *suffix) {
+    snprintf(path, size, "%s/%016llx%s", dir, (unsigned long long) hash, suffix);
+}
+//-----------------------------------------------------------------------------------
+// Write a compiled script next to the others, replacing the file atomically
+//-----------------------------------------------------------------------------------
+void cache_save(char *dir, char *image, size_t size) {
+    char path[PATH_MAX], temp[PATH_MAX + 32];
+    uint64_t hash = ((struct cache_header *) image)->hash;
+    cache_path(path, sizeof(path), dir, hash, ".msc");
+    snprintf(temp, sizeof(temp), "%s.%d", path, (int) getpid());
+    int fd = open(temp, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    // the first script made with a new cache makes its directory
+    if (fd < 0 && errno == ENOENT && cache_mkdir(dir) == 0) {
+        fd = open(temp, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    }
+    if (fd < 0) {
+        report(dir);
+        return;
+    }
+    size_t done = 0;
+    ssize_t n;
+    while (done < size) {
+        if ((n = write(fd, image + done, size - done)) < 0) {
+            if (errno == EINTR) {
+                continue;
             }
+            report("write");
+            break;
         }
-    // LINKHARD
-    } else if (strcmp(com, "linkhard") == 0) {
-        if (opt[2] == 0) {
-            fun_linkhard();
-        } else {
-            int pid = fork();
-            if (pid < 0) {
-                perror("fork");
-            } else if (pid == 0) {
-                fun_linkhard();
-                exit(0);
-            }
+        done += n;
+    }
+    if (close(fd) < 0 || done < size || rename(temp, path) < 0) {
+        if (done == size) {
+            report("rename");
         }
-    // LINKSOFT
-    } else if (strcmp(com, "linksoft") == 0) {
-        if (opt[2] == 0) {
-            fun_linksoft();
-        } else {
-            int pid = fork();
-            if (pid < 0) {
-                perror("fork");
-            } else if (pid == 0) {
-                fun_linksoft();
-                exit(0);
+        unlink(temp);
+    }
+}
+//-----------------------------------------------------------------------------------
+// Make the cache directory and the ones above it that are missing, like mkdir -p
+//-----------------------------------------------------------------------------------
+int cache_mkdir(char *dir) {
+    char path[PATH_MAX];
+    char *p;
+    if (snprintf(path, sizeof(path), "%s", dir) >= (int) sizeof(path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    for (p = path + 1; *p != '\0'; p++) {
+        if (*p == '/') {
+            *p = '\0';
+            if (mkdir(path, 0755) < 0 && errno != EEXIST) {
+                return -1;
             }
+            *p = '/';
         }
-    // LINKREAD
-    } else if (strcmp(com, "linkread") == 0) {
-        if (opt[2] == 0) {
-            fun_linkread();
-        } else {
-            int pid = fork();
-            if (pid < 0) {
-                perror("fork");
-            } else if (pid == 0) {
-                fun_linkread();
-                exit(0);
-            }
+    }
+    return mkdir(path, 0755) < 0 && errno != EEXIST ? -1 : 0;
+}
+//-----------------------------------------------------------------------------------
+// Map the compiled form of a script, NULL when there is no valid one
+//-----------------------------------------------------------------------------------
+char *cache_load(char *dir, uint64_t hash, size_t size, size_t *length) {
+    char path[PATH_MAX];
+    struct stat st;
+    cache_path(path, sizeof(path), dir, hash, ".msc");
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return NULL;
+    }
+    if (fstat(fd, &st) < 0 || (size_t) st.st_size < sizeof(struct cache_header)) {
+        close(fd);
+        return NULL;
+    }
+    // private and writable: pipes splits its arguments in place
+    char *image = (char *) mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (image == MAP_FAILED) {
+        return NULL;
+    }
+    // another script with the same hash, or a shell with other builtins
+    struct cache_header *h = (struct cache_header *) image;
+    if (memcmp(h->magic, CACHE_MAGIC, sizeof(h->magic)) != 0 || h->hash != hash || h->size != size
+            || h->builtins != B_COUNT || !cache_valid(image, st.st_size)) {
+        munmap(image, st.st_size);
+        return NULL;
+    }
+    madvise(image, st.st_size, MADV_SEQUENTIAL);
+    *length = st.st_size;
+    return image;
+}
+//-----------------------------------------------------------------------------------
+// Whether every record of a mapped image is whole and makes sense to this shell, so
+// that a stale or damaged file is compiled again rather than run
+//-----------------------------------------------------------------------------------
+int cache_valid(char *image, size_t size) {
+    struct cache_header *h = (struct cache_header *) image;
+    char *p = image + sizeof(struct cache_header), *end = image + size;
+    uint32_t n, j;
+    for (n = 0; n < h->commands; n++) {
+        struct cache_command *c = (struct cache_command *) p;
+        if ((size_t) (end - p) < sizeof(struct cache_command) || c->size > (size_t) (end - p)
+                || c->size < sizeof(struct cache_command) + c->count * sizeof(uint32_t) + c->count
+                || (c->size & 7) != 0 || p[c->size - 1] != '\0' || c->args >= c->count
+                || c->b < CACHE_ERROR || c->b >= B_COUNT || (c->b == CACHE_ERROR && c->count != 1)) {
+            return 0;
         }
-    // LINKLIST
-    } else if (strcmp(com, "linklist") == 0) {
-        if (opt[2] == 0) {
-            fun_linklist();
-        } else {
-            int pid = fork();
-            if (pid < 0) {
-                perror("fork");
-            } else if (pid == 0) {
-                fun_linklist();
-                exit(0);
+        for (j = 0; j < c->count; j++) {
+            char *symbol = p + c->offset[j];
+            if (c->offset[j] < sizeof(struct cache_command) + c->count * sizeof(uint32_t) || c->offset[j] >= c->size) {
+                return 0;
             }
-        }
-    // UNLINK
-    } else if (strcmp(com, "unlink") == 0) {
-        if (opt[2] == 0) {
-            fun_unlink();
-        } else {
-            int pid = fork();
-            if (pid < 0) {
-                perror("fork");
-            } else if (pid == 0) {
-                fun_unlink();
-                exit(0);
+            // the redirections: a descriptor, how, and a file or another descriptor
+            if (c->b != CACHE_ERROR && j > c->args && (symbol[0] < '0' || symbol[0] > '2' || symbol[1] == '\0'
+                    || strchr("<>+=&", symbol[1]) == NULL || (symbol[1] == '&' && (symbol[2] < '0' || symbol[2] > '2')))) {
+                return 0;
             }
         }
-    // RENAME
-    } else if (strcmp(com, "rename") == 0) {
-        if (opt[2] == 0) {
-            fun_rename();
-        } else {
-            int pid = fork();
-            if (pid < 0) {
-                perror("fork");
-            } else if (pid == 0) {
-                fun_rename();
-                exit(0);
+        p += c->size;
+    }
+    return 1;
+}
+//-----------------------------------------------------------------------------------
+// Execute a compiled script
+//-----------------------------------------------------------------------------------
+void cache_run(char *image) {
+    struct cache_header *h = (struct cache_header *) image;
+    // how each redirection opens its file, by its letter in the cache
+    char *hows = "<>+=&";
+    int flags[] = {O_RDONLY, O_WRONLY | O_CREAT | O_TRUNC, O_WRONLY | O_CREAT | O_APPEND, O_RDWR | O_CREAT, 0};
+    char *p = image + sizeof(struct cache_header);
+    uint32_t n, j;
+    for (n = 0; n < h->commands; n++) {
+        struct cache_command *c = (struct cache_command *) p;
+        p += c->size;
+        // a line that didn't parse is reported again, like without the cache
+        if (c->b == CACHE_ERROR) {
+            fputs((char *) c + c->offset[0], err);
+            if (c->opt) {
+                status = EXIT_FAILURE;
             }
+            continue;
         }
-    // CPCAT
-    } else if (strcmp(com, "cpcat") == 0) {
-        if (opt[2] == 0) {
-            fun_cpcat(i);
-        } else {
-            int pid = fork();
-            if (pid < 0) {
-                perror("fork");
-            } else if (pid == 0) {
-                fun_cpcat(i);
-                exit(0);
-            }
+        tokens = (char **) arena_alloc((c->count + 2) * sizeof(char *));
+        for (j = 0; j < c->count; j++) {
+            tokens[j] = (char *) c + c->offset[j];
         }
-    // PIPES
-    } else if (strcmp(com, "pipes") == 0) {
-        if (opt[2] == 0) {
-            fun_pipes(i);
-        } else {
-            int pid = fork();
-            if (pid < 0) {
-                perror("fork");
-            } else if (pid == 0) {
-                fun_pipes(i);
-                exit(0);
-            }
+        // the symbols after the arguments are the redirections
+        token_count = c->args + 1;
+        redirect_count = c->count - token_count;
+        redirects = (struct redirect *) arena_alloc((redirect_count + 1) * sizeof(struct redirect));
+        for (j = 0; j < (uint32_t) redirect_count; j++) {
+            struct redirect *r = &redirects[j];
+            char *how = tokens[token_count + j], *k = strchr(hows, how[1]);
+            r->fd = how[0] - '0';
+            r->flags = flags[k - hows];
+            r->dup = *k == '&' ? how[2] - '0' : -1;
+            r->path = *k == '&' ? NULL : how + 2;
         }
-    //-------------------------------------------------------------------------------
-    // EXTERNAL COMMANDS
-    //-------------------------------------------------------------------------------
-    } else {
-        // foreground
-        if (opt[2] == 0) {
-            fun_exec_front(opt);
-        // background
-        } else {
-            fun_exec_back(opt);
+        tokens[token_count] = NULL;
+        opt = (int *) arena_alloc(3 * sizeof(int));
+        opt[0] = c->opt & 1;
+        opt[1] = (c->opt >> 1) & 1;
+        opt[2] = (c->opt >> 2) & 1;
+        execute(c->b, c->args);
+        arena_reset();
+        // collect the background jobs that have finished
+        if (job_running > 0) {
+            jobs_reap();
         }
     }
-    // renew the descriptor state
-    if (opt[1] == 1)
-        fflush(stdout);
-    for (j = 0; j < 2; j++) {
-        if (dup2(fd[j], j) < 0) {
-            perror("dup2");
-        }
-        if (close(fd[j]) < 0) {
-            perror("close");
+}
+//-----------------------------------------------------------------------------------
+// Start a writer on a descriptor
+//-----------------------------------------------------------------------------------
+void writer_init(struct writer *w, int fd) {
+    w->fd = fd;
+    w->used = 0;
+    w->error = 0;
+    w->stream = NULL;
+    w->eager = 0;
+}
+//-----------------------------------------------------------------------------------
+// Append to the writer's buffer, writing it out when it fills up
+//-----------------------------------------------------------------------------------
+void writer_put(struct writer *w, char *data, size_t len) {
+    while (len > 0) {
+        if (w->used == WRITER_BUF && writer_flush(w) < 0) {
+            return;
         }
+        size_t n = WRITER_BUF - w->used < len ? WRITER_BUF - w->used : len;
+        memcpy(w->buf + w->used, data, n);
+        w->used += n;
+        data += n;
+        len -= n;
     }
 }
 //-----------------------------------------------------------------------------------
-// Set current directory
+// Write out the buffer; after an error everything else is dropped
 //-----------------------------------------------------------------------------------
-void set_cwd() {
-    long size = pathconf(".", _PC_PATH_MAX);
-    cwd = (char *) malloc((size_t) size);
-    if (getcwd(cwd, (size_t) size) == NULL) {
-        int e = errno;
-        perror("getcwd");
-        exit(e);
+int writer_flush(struct writer *w) {
+    size_t done = 0;
+    ssize_t n;
+    while (done < w->used && !w->error) {
+        if ((n = write(w->fd, w->buf + done, w->used - done)) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EPIPE) {
+                report("write");
+            }
+            w->error = 1;
+        } else {
+            done += n;
+        }
     }
+    w->used = 0;
+    return w->error ? -1 : 0;
 }
 //-----------------------------------------------------------------------------------
-// Print or change shell name
+// Append a line given in parts iov[1..n]; iov[0] is left for the buffer, so a line
+// that does not fit goes out together with it in one writev
 //-----------------------------------------------------------------------------------
-void fun_name(int args) {
-    if (args == 1) {
-        name = tokens[1];
-    } else {
-        printf("%s\n", name);
+void writer_putv(struct writer *w, struct iovec *iov, int n) {
+    size_t size = 0;
+    ssize_t done;
+    int i;
+    for (i = 1; i <= n; i++) {
+        size += iov[i].iov_len;
+    }
+    if (w->used + size <= WRITER_BUF) {
+        for (i = 1; i <= n; i++) {
+            memcpy(w->buf + w->used, iov[i].iov_base, iov[i].iov_len);
+            w->used += iov[i].iov_len;
+        }
+        return;
+    }
+    iov[0].iov_base = w->buf;
+    iov[0].iov_len = w->used;
+    n++;
+    while (n > 0 && !w->error) {
+        if ((done = writev(w->fd, iov, n < IOV_MAX ? n : IOV_MAX)) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EPIPE) {
+                report("write");
+            }
+            w->error = 1;
+            break;
+        }
+        // skip the parts written whole, and cut into the one written in part
+        while (n > 0 && (size_t) done >= iov->iov_len) {
+            done -= iov->iov_len;
+            iov++;
+            n--;
+        }
+        if (n > 0) {
+            iov->iov_base = (char *) iov->iov_base + done;
+            iov->iov_len -= done;
+        }
     }
+    w->used = 0;
 }
 //-----------------------------------------------------------------------------------
-// Print help
+// The thread's output writer, bound to its out; whatever out itself holds is older,
+// so it goes first
 //-----------------------------------------------------------------------------------
-void fun_help() {
-    char commands[][10] = {
-        "name", "help", "status", "exit", "print", "echo", "pid", "ppid", "dir",
-        "dirwhere", "dirmake", "dirremove", "dirlist", "linkhard", "linksoft",
-        "linkread", "linklist", "unlink", "rename", "cpcat", "pipes"
-    };
-    char description[][32] = {
-        "Print or change shell name", "Print short help", "Print last command status",
-        "Exit from shell", "Print arguments", "Print arguments and newline", "Print PID",
-        "Print PPID", "Change directory", "Print current working directory",
-        "Make directory", "Remove directory", "List directory", "Create hard link",
-        "Creat symbolic/soft link", "Print symbolic link target", "Print hard links",
-        "Unlink file", "Rename file", "Copy file", "Create pipeline"};
-    int i;
-    for (i = 0; i < 21; i++) {
-        printf("%9s - %s\n", commands[i], description[i]);
-        fflush(stdout);
+struct writer *out_writer() {
+    if (output == NULL) {
+        if ((output = (struct writer *) malloc(sizeof(struct writer))) == NULL) {
+            report("malloc");
+            return NULL;
+        }
+        writer_init(output, -1);
     }
+    if (output->stream != out || __fpending(out) > 0) {
+        out_flush();
+        if (output->stream != out) {
+            output->fd = fileno(out);
+            output->stream = out;
+            output->eager = out_eager(out);
+        }
+    }
+    return output;
 }
 //-----------------------------------------------------------------------------------
-// Print last output status of a foreground process
+// A builtin is done with the output writer; returns 1 if writing failed
 //-----------------------------------------------------------------------------------
-void fun_status() {
-    printf("%d\n", status);
+int out_end(struct writer *w) {
+    if (w->eager) {
+        writer_flush(w);
+    }
+    int stat = w->error;
+    w->error = 0;
+    return stat;
 }
 //-----------------------------------------------------------------------------------
-// Exit
+// Write out the output writer, then out: at command boundaries where the order with
+// other writers matters (external commands, redirections, the prompt, exit)
 //-----------------------------------------------------------------------------------
-void fun_exit(int args) {
-    int stat = 0;
-    if (args == 1) {
-        stat = atoi(tokens[1]);
+void out_flush() {
+    if (output != NULL && output->used > 0) {
+        writer_flush(output);
+        output->error = 0;
     }
-    exit(stat);
+    fflush(out);
 }
 //-----------------------------------------------------------------------------------
-// Print without new line
+// Close out, the output writer is bound to it no more
 //-----------------------------------------------------------------------------------
-void fun_print(int args) {
-    int i;
-    for (i = 1; i <= args; i++) {
-        printf("%s", tokens[i]);
-        if (i < args) {
-            printf(" ");
-        }
+void out_close() {
+    out_flush();
+    if (output != NULL) {
+        output->stream = NULL;
     }
-    fflush(stdout);
+    fclose(out);
 }
 //-----------------------------------------------------------------------------------
-// Print with new line
+// Make another stream out; the output writer follows it right away when whether it is
+// eager is known (0 or 1), otherwise on its next use
 //-----------------------------------------------------------------------------------
-void fun_echo(int args) {
-    int i;
-    for (i = 1; i <= args; i++) {
-        printf("%s", tokens[i]);
-        if (i < args) {
-            printf(" ");
-        }
+void out_switch(FILE *stream, int eager) {
+    out_flush();
+    out = stream;
+    if (output != NULL) {
+        output->stream = eager < 0 ? NULL : stream;
+        output->fd = fileno(stream);
+        output->eager = eager;
     }
-    printf("\n");
 }
 //-----------------------------------------------------------------------------------
-// Print PID
+// Whether output on the stream can't wait: a terminal, or the same file as the
+// errors, which are written as they happen
 //-----------------------------------------------------------------------------------
-void fun_pid() {
-    printf("%d\n", getpid());
+int out_eager(FILE *stream) {
+    struct stat o, e;
+    int fd = fileno(stream);
+    if (isatty(fd)) {
+        return 1;
+    }
+    return err != NULL && fstat(fd, &o) == 0 && fstat(fileno(err), &e) == 0
+        && !S_ISCHR(o.st_mode) && o.st_dev == e.st_dev && o.st_ino == e.st_ino;
 }
 //-----------------------------------------------------------------------------------
-// Print PPID
+// Run the rest of the line as a command and report its real, user and sys time
 //-----------------------------------------------------------------------------------
-void fun_ppid() {
-    printf("%d\n", getppid());
+int fun_time(int args) {
+    struct timespec start, end;
+    struct rusage self[2], children[2];
+    char **saved = tokens;
+    int stat;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    getrusage(RUSAGE_SELF, &self[0]);
+    getrusage(RUSAGE_CHILDREN, &children[0]);
+    // the redirections of the line already apply to time itself
+    tokens++;
+    int b = find_builtin(tokens[0]);
+    if (b < 0) {
+        fun_exec_front(args - 1, NULL, 0);
+        stat = status;
+    } else if (args - 1 < builtins[b].args) {
+        fprintf(err, "%s: missing operand\n", builtins[b].name);
+        stat = EXIT_FAILURE;
+    } else {
+        stat = builtins[b].fun(args - 1);
+    }
+    tokens = saved;
+    out_flush();
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    getrusage(RUSAGE_SELF, &self[1]);
+    getrusage(RUSAGE_CHILDREN, &children[1]);
+    double user = (self[1].ru_utime.tv_sec - self[0].ru_utime.tv_sec + children[1].ru_utime.tv_sec - children[0].ru_utime.tv_sec)
+        + (self[1].ru_utime.tv_usec - self[0].ru_utime.tv_usec + children[1].ru_utime.tv_usec - children[0].ru_utime.tv_usec) / 1e6;
+    double sys = (self[1].ru_stime.tv_sec - self[0].ru_stime.tv_sec + children[1].ru_stime.tv_sec - children[0].ru_stime.tv_sec)
+        + (self[1].ru_stime.tv_usec - self[0].ru_stime.tv_usec + children[1].ru_stime.tv_usec - children[0].ru_stime.tv_usec) / 1e6;
+    fprintf(err, "real %.3fs\nuser %.3fs\nsys  %.3fs\n",
+        (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9, user, sys);
+    return stat;
 }
 //-----------------------------------------------------------------------------------
-// Change directory
+// Print the counters and a latency histogram per command, or reset them (-r)
 //-----------------------------------------------------------------------------------
-void fun_dir(int args) {
-    char *path = "/";
-    if (args == 1) {
-        path = tokens[1];
+int fun_stats(int args) {
+    char bound[16];
+    int b, k;
+    // workers and pipeline stages count at the same time: every counter is reset on
+    // its own, they are all unsigned longs
+    if (args == 1 && strcmp(tokens[1], "-r") == 0) {
+        unsigned long *counter = (unsigned long *) &stats;
+        size_t i;
+        for (i = 0; i < sizeof(stats) / sizeof(unsigned long); i++) {
+            __atomic_store_n(&counter[i], 0, __ATOMIC_RELAXED);
+        }
+        return 0;
     }
-    if (chdir(path) < 0) {
-        perror("dir");
+    fprintf(out, "forks        %lu\n", __atomic_load_n(&stats.forks, __ATOMIC_RELAXED));
+    fprintf(out, "spawns       %lu\n", __atomic_load_n(&stats.spawns, __ATOMIC_RELAXED));
+    fprintf(out, "pipe stages  %lu\n", __atomic_load_n(&stats.stages, __ATOMIC_RELAXED));
+    fprintf(out, "cpcat bytes  %lu\n", __atomic_load_n(&stats.copied, __ATOMIC_RELAXED));
+    fprintf(out, "input reads  %lu\n", __atomic_load_n(&stats.reads, __ATOMIC_RELAXED));
+    fprintf(out, "%-10s %8s  %s\n", "command", "count", "latency: below bound/count");
+    for (b = 0; b <= STAT_EXTERNAL; b++) {
+        unsigned long n = __atomic_load_n(&stats.commands[b], __ATOMIC_RELAXED);
+        if (n == 0) {
+            continue;
+        }
+        fprintf(out, "%-10s %8lu ", b == STAT_EXTERNAL ? "(external)" : builtins[b].name, n);
+        for (k = 0; k < STAT_BUCKETS; k++) {
+            unsigned long c = __atomic_load_n(&stats.latency[b][k], __ATOMIC_RELAXED);
+            if (c > 0) {
+                stat_bound(bound, sizeof(bound), k);
+                fprintf(out, " %s/%lu", bound, c);
+            }
+        }
+        fprintf(out, "\n");
     }
+    return 0;
 }
 //-----------------------------------------------------------------------------------
-// Print current directory
+// Add to a counter from any thread
 //-----------------------------------------------------------------------------------
-void fun_dirwhere() {
-    set_cwd();
-    printf("%s\n", cwd);
+void stat_add(unsigned long *counter, unsigned long n) {
+    __atomic_add_fetch(counter, n, __ATOMIC_RELAXED);
 }
 //-----------------------------------------------------------------------------------
-// Create a new directory
+// Count a command of type b (external when b < 0) and put its latency in a bucket
 //-----------------------------------------------------------------------------------
-void fun_dirmake() {
-    if (mkdir(tokens[1], S_IRWXU) < 0) {
-        perror("dirmake");
+void stat_command(int b, struct timespec *start, struct timespec *end) {
+    unsigned long us = (end->tv_sec - start->tv_sec) * 1000000 + (end->tv_nsec - start->tv_nsec) / 1000;
+    int k = us == 0 ? 0 : 64 - __builtin_clzl(us);
+    if (b < 0) {
+        b = STAT_EXTERNAL;
     }
+    stat_add(&stats.commands[b], 1);
+    stat_add(&stats.latency[b][k < STAT_BUCKETS ? k : STAT_BUCKETS - 1], 1);
 }
 //-----------------------------------------------------------------------------------
-// Delete a directory
+// Upper bound of bucket k as text
 //-----------------------------------------------------------------------------------
-void fun_dirremove() {
-    if (rmdir(tokens[1]) < 0) {
-        perror("dirremove");
+void stat_bound(char *buf, size_t size, int k) {
+    double us = (double) (1UL << k);
+    if (us < 1000) {
+        snprintf(buf, size, "%.0fus", us);
+    } else if (us < 1e6) {
+        snprintf(buf, size, "%.3gms", us / 1e3);
+    } else {
+        snprintf(buf, size, "%.3gs", us / 1e6);
     }
 }
 //-----------------------------------------------------------------------------------
-// Print files in a directory
+// Turn tracing on or off, or write the trace out in Chrome's trace event format
 //-----------------------------------------------------------------------------------
-void fun_dirlist(int args) {
-    // set current directory
-    set_cwd();
-    char *path = cwd;
-    if (args == 1) {
-        path = tokens[1];
+int fun_debug(int args) {
+    struct trace_ring *r;
+    if (args == 2 && strcmp(tokens[1], "dump") == 0) {
+        return trace_dump(tokens[2]);
     }
-    // process the directory
-    DIR *dirp;
-    struct dirent *entry;
-    // open the directory
-    if ((dirp = opendir(path)) == NULL) {
-        perror("opendir");
+    if (args > 1 || (args == 1 && strcmp(tokens[1], "on") != 0 && strcmp(tokens[1], "off") != 0)) {
+        fprintf(err, "usage: debug [on|off] | debug dump file.json\n");
+        return 1;
     }
-    // read files in the directory
-    int i = 0;
-    while (1) {
-        errno = 0;
-        if ((entry = readdir(dirp)) != NULL) {
-            // reading was successful
-            if (i++ > 0) {
-                printf("  ");
-            }
-            printf("%s", entry->d_name);
-        } else {
-            // reading was unsuccessful
-            if (errno != 0) {
-                perror("readdir");
-                return;
-            // no more files in the directory, so we close it
-            } else {
-                printf("\n");
-                if (closedir(dirp) < 0) {
-                    perror("closedir");
-                }
-                break;
-            }
+    int on = args == 1 ? tokens[1][1] == 'n' : !tracing;
+    // a new trace starts empty
+    if (on && !tracing) {
+        pthread_mutex_lock(&trace_lock);
+        for (r = trace_rings; r != NULL; r = r->next) {
+            __atomic_store_n(&r->head, 0, __ATOMIC_RELEASE);
         }
+        pthread_mutex_unlock(&trace_lock);
     }
+    __atomic_store_n(&tracing, on, __ATOMIC_RELAXED);
+    fprintf(out, "debug %s\n", on ? "on" : "off");
+    return 0;
 }
 //-----------------------------------------------------------------------------------
-// Create a hard link
+// Timestamp of the start of an event, 0 while tracing is off
 //-----------------------------------------------------------------------------------
-void fun_linkhard() {
-    if (link(tokens[1], tokens[2]) < 0) {
-        perror("linkhard");
+uint64_t trace_start() {
+    struct timespec now;
+    if (!__atomic_load_n(&tracing, __ATOMIC_RELAXED)) {
+        return 0;
     }
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
 }
 //-----------------------------------------------------------------------------------
-// Create a soft link
+// Record an event that started at start in this thread's ring
 //-----------------------------------------------------------------------------------
-void fun_linksoft() {
-    if (symlink(tokens[1], tokens[2]) < 0) {
-        perror("linksoft");
+void trace_end(int cat, char *name, uint64_t start) {
+    struct trace_ring *r = trace_mine;
+    if (start == 0 || !__atomic_load_n(&tracing, __ATOMIC_RELAXED)) {
+        return;
+    }
+    // the first event of a thread takes a ring a finished thread gave back, or a new one
+    if (r == NULL) {
+        pthread_mutex_lock(&trace_lock);
+        for (r = trace_rings; r != NULL && r->busy; r = r->next) { }
+        if (r == NULL && (r = (struct trace_ring *) calloc(1, sizeof(struct trace_ring))) != NULL) {
+            r->next = trace_rings;
+            trace_rings = r;
+        }
+        if (r != NULL) {
+            r->busy = 1;
+        }
+        pthread_mutex_unlock(&trace_lock);
+        if (r == NULL) {
+            return;
+        }
+        trace_mine = r;
+        trace_tid = gettid();
     }
+    unsigned long head = r->head;
+    struct trace_event *e = &r->events[head % TRACE_EVENTS];
+    e->ts = start;
+    e->dur = trace_start() - start;
+    e->tid = trace_tid;
+    e->cat = cat;
+    strncpy(e->name, name != NULL ? name : "", sizeof(e->name) - 1);
+    e->name[sizeof(e->name) - 1] = '\0';
+    __atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
 }
 //-----------------------------------------------------------------------------------
-// Print the target of the soft link
+// Give this thread's ring back when the thread ends; its events stay in it
 //-----------------------------------------------------------------------------------
-void fun_linkread() {
-    char path[512];
-    int n;
-    if ((n = readlink(tokens[1], path, sizeof(path))) < 0) {
-        perror("linkread");
-    } else {
-        path[n] = '\0';
-        printf("%s\n", path);
+void trace_release() {
+    if (trace_mine != NULL) {
+        pthread_mutex_lock(&trace_lock);
+        trace_mine->busy = 0;
+        pthread_mutex_unlock(&trace_lock);
+        trace_mine = NULL;
     }
 }
 //-----------------------------------------------------------------------------------
-// Print all links to the file
+// Write every ring to a file as Chrome trace events (chrome://tracing, Perfetto)
 //-----------------------------------------------------------------------------------
-void fun_linklist() {
-    // set current directory
-    set_cwd();
-    char *path = cwd;
-    // find file's inode no.
-    struct stat file;
-    if (stat(tokens[1], &file) < 0) {
-        perror("stat");
+int trace_dump(char *file) {
+    struct writer *w = (struct writer *) malloc(sizeof(struct writer));
+    struct trace_ring *r;
+    char line[256], name[64];
+    unsigned long head, i;
+    int fd, len, n = 0, pid = getpid();
+    if (w == NULL) {
+        report("malloc");
+        return 1;
     }
-    ino_t inode = file.st_ino;
-    // find files with same inode no. as the given file's
-    DIR *dirp;
-    struct dirent *entry;
-    // open the directory
-    if ((dirp = opendir(path)) == NULL) {
-        perror("opendir");
+    if ((fd = openat(cwdfd, file, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666)) < 0) {
+        report("open");
+        free(w);
+        return 1;
     }
-    // read the files from the directory and print those with same inode no.
-    int i = 0;
-    while (1) {
-        errno = 0;
-        if ((entry = readdir(dirp)) != NULL) {
-            // reading successful
-            if (entry->d_ino == inode) {
-                if (i++ > 0) printf("  ");
-                printf("%s", entry->d_name);
+    writer_init(w, fd);
+    len = snprintf(line, sizeof(line), "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [\n"
+        "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": %d, \"args\": {\"name\": \"%s\"}}", pid, "mysh");
+    writer_put(w, line, len);
+    pthread_mutex_lock(&trace_lock);
+    for (r = trace_rings; r != NULL; r = r->next) {
+        head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+        for (i = head > TRACE_EVENTS ? head - TRACE_EVENTS : 0; i < head; i++) {
+            struct trace_event *e = &r->events[i % TRACE_EVENTS];
+            // names come from command lines: escape what JSON doesn't allow
+            char *p, *q = name;
+            for (p = e->name; *p != '\0'; p++) {
+                if (*p == '"' || *p == '\\') {
+                    *q++ = '\\';
+                }
+                *q++ = (unsigned char) *p < ' ' ? ' ' : *p;
             }
-        } else {
-            // reading unsuccessful
-            if (errno != 0) {
-                perror("readdir");
-                return;
-            // no more files in the directory, so we close it
+            *q = '\0';
+            if (e->cat == T_REAP) {
+                len = snprintf(line, sizeof(line), ",\n{\"name\": \"%s\", \"cat\": \"%s\", \"ph\": \"i\", \"s\": \"t\", "
+                    "\"ts\": %.3f, \"pid\": %d, \"tid\": %d}", name, trace_names[e->cat], e->ts / 1e3, pid, e->tid);
             } else {
-                printf("\n");
-                if (closedir(dirp) < 0) {
-                    perror("closedir");
-                }
-                break;
+                len = snprintf(line, sizeof(line), ",\n{\"name\": \"%s\", \"cat\": \"%s\", \"ph\": \"X\", "
+                    "\"ts\": %.3f, \"dur\": %.3f, \"pid\": %d, \"tid\": %d}", name, trace_names[e->cat], e->ts / 1e3,
+                    e->dur / 1e3, pid, e->tid);
             }
+            writer_put(w, line, len);
+            n++;
         }
     }
+    pthread_mutex_unlock(&trace_lock);
+    writer_put(w, "\n]}\n", 4);
+    int stat = writer_flush(w) < 0;
+    if (close(fd) < 0) {
+        report("close");
+        stat = 1;
+    }
+    free(w);
+    fprintf(out, "%d events written to %s\n", n, file);
+    return stat;
 }
 //-----------------------------------------------------------------------------------
-// Delete a file
+// Serve sessions on a unix socket: this loop waits for clients and their input, a
+// pool of threads runs the lines they send
 //-----------------------------------------------------------------------------------
-void fun_unlink() {
-    if (unlink(tokens[1]) < 0) {
-        perror("unlink");
+int serve(char *path) {
+    struct sockaddr_un addr;
+    struct epoll_event ev, events[SERVE_EVENTS];
+    int i, n, fd, started = 0;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(err, "%s: socket path too long\n", path);
+        return EXIT_FAILURE;
+    }
+    strcpy(addr.sun_path, path);
+    if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0) {
+        report("socket");
+        return EXIT_FAILURE;
+    }
+    // a socket left behind by an earlier server is replaced
+    unlink(path);
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        report("bind");
+        return EXIT_FAILURE;
+    }
+    if (listen(fd, SOMAXCONN) < 0) {
+        report("listen");
+        return EXIT_FAILURE;
+    }
+    // sessions have no input but their lines
+    if ((serve_null = open("/dev/null", O_RDONLY | O_CLOEXEC)) < 0) {
+        report("open");
+        return EXIT_FAILURE;
+    }
+    if ((serve_epoll = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+        report("epoll_create1");
+        return EXIT_FAILURE;
+    }
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(serve_epoll, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        report("epoll_ctl");
+        return EXIT_FAILURE;
+    }
+    for (i = 0; i < SERVE_THREADS; i++) {
+        pthread_t thread;
+        if ((errno = pthread_create(&thread, NULL, serve_run, NULL)) != 0) {
+            report("pthread_create");
+        } else {
+            pthread_detach(thread);
+            started++;
+        }
+    }
+    if (started == 0) {
+        return EXIT_FAILURE;
+    }
+    while (1) {
+        if ((n = epoll_wait(serve_epoll, events, SERVE_EVENTS, -1)) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            report("epoll_wait");
+            return EXIT_FAILURE;
+        }
+        for (i = 0; i < n; i++) {
+            struct session *s = (struct session *) events[i].data.ptr;
+            // new clients
+            if (s == NULL) {
+                int client;
+                while ((client = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+                    session_open(client);
+                }
+                if (errno != EAGAIN && errno != EINTR) {
+                    report("accept");
+                }
+                continue;
+            }
+            // input: the session goes to a thread, with its events off until it's back
+            pthread_mutex_lock(&serve_lock);
+            s->next = NULL;
+            if (serve_tail != NULL) {
+                serve_tail->next = s;
+            } else {
+                serve_head = s;
+            }
+            serve_tail = s;
+            pthread_cond_signal(&serve_ready);
+            pthread_mutex_unlock(&serve_lock);
+        }
     }
 }
 //-----------------------------------------------------------------------------------
-// Rename a file
+// Start a session for a client, in the directory the server was started in
 //-----------------------------------------------------------------------------------
-void fun_rename() {
-    if (rename(tokens[1], tokens[2]) < 0) {
-        perror("rename");
+void session_open(int fd) {
+    struct epoll_event ev;
+    struct session *s = (struct session *) calloc(1, sizeof(struct session));
+    if (s == NULL) {
+        report("calloc");
+        close(fd);
+        return;
+    }
+    s->fd = fd;
+    s->cwdfd = -1;
+    s->name = "mysh";
+    reader_init(&s->r, fd);
+    if ((s->cwdfd = fcntl(cwdfd, F_DUPFD_CLOEXEC, 0)) < 0 || (s->cwd = strdup(cwd)) == NULL) {
+        report("dup");
+        session_close(s);
+        return;
+    }
+    if ((s->out = session_stream("out")) == NULL || (s->err = session_stream("err")) == NULL) {
+        session_close(s);
+        return;
+    }
+    // errors are written as they happen, like to a terminal
+    setvbuf(s->err, NULL, _IONBF, 0);
+    ev.events = EPOLLIN | EPOLLONESHOT;
+    ev.data.ptr = s;
+    if (epoll_ctl(serve_epoll, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        report("epoll_ctl");
+        session_close(s);
     }
 }
 //-----------------------------------------------------------------------------------
-// Copy a file or print its content to the standard output
+// A stream that keeps what a session writes until it is sent; builtins and external
+// commands both append to its memfd
 //-----------------------------------------------------------------------------------
-void fun_cpcat(int args) {
-    int fdin = 0;
-    // open the descriptor: input from file
-    if (args >= 1 && strcmp(tokens[1], "-") != 0) {
-        if ((fdin = open(tokens[1], O_RDONLY)) < 0) {
-            perror("open");
-            return;
+FILE *session_stream(char *name) {
+    FILE *f = NULL;
+    int fd = memfd_create(name, MFD_CLOEXEC);
+    if (fd < 0 || fcntl(fd, F_SETFL, O_APPEND) < 0 || (f = fdopen(fd, "w")) == NULL) {
+        report("memfd_create");
+        if (fd >= 0) {
+            close(fd);
         }
     }
-    int fdout = 1;
-    // open the descriptor: output to file
-    if (args == 2 && strcmp(tokens[2], "-") != 0) {
-        if ((fdout = open(tokens[2], O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0) {
-            perror("open");
-            return;
+    return f;
+}
+//-----------------------------------------------------------------------------------
+// Server thread: run the sessions that have input, one after another
+//-----------------------------------------------------------------------------------
+void *serve_run(void *arg) {
+    struct session *s;
+    while (1) {
+        pthread_mutex_lock(&serve_lock);
+        while (serve_head == NULL) {
+            pthread_cond_wait(&serve_ready, &serve_lock);
         }
-    }
-    // copy the content of the input file into the output file
-    char *buffer = (char *) malloc(1024 * sizeof(char));
-    char c[1];
-    int i = 0, j = 1;
-    while (read(fdin, c, 1) > 0) {
-        buffer[i++] = c[0];
-        if (i % 1024 == 0) {
-            buffer = (char *) realloc(buffer, (++j) * 1024 * sizeof(char));
+        s = serve_head;
+        if ((serve_head = s->next) == NULL) {
+            serve_tail = NULL;
         }
+        pthread_mutex_unlock(&serve_lock);
+        session_run(s);
     }
-    if (write(fdout, buffer, i) < 0) {
-        int e = errno;
-        perror("write");
-        exit(e);
-    }
-    // close the descriptors
-    if (fdin != 0 && close(fdin) < 0) {
-        int e = errno;
-        perror("close");
-        exit(e);
-    }
-    if (fdout != 1 && close(fdout) < 0) {
-        int e = errno;
-        perror("close");
-        exit(e);
-    }
+    return NULL;
 }
 //-----------------------------------------------------------------------------------
-// Create pipeline
+// Run every whole line the client has sent so far and answer each of them
 //-----------------------------------------------------------------------------------
-void fun_pipes(int args) {
-    // parse the pipeline commands
-    int i, j = 0, k = 0;
-    count = (int *) malloc(args * sizeof(int));
-    split = (char ***) malloc(args * sizeof(char **));
-    for (i = 1; i <= args; i++) {
-        split[j] = NULL;
-        char *p = strtok(tokens[i], " ");
-        while (p != NULL) {
-            split[j] = (char **) realloc(split[j], (j+1) * sizeof(char *));
-            split[j][k] = (char *) malloc((strlen(p)+1) * sizeof(char));
-            strcpy(split[j][k++], p);
-            p = strtok(NULL, " ");
+void session_run(struct session *s) {
+    struct epoll_event ev;
+    char *line;
+    size_t len;
+    // the session's state becomes the thread's while it runs
+    session = s;
+    cwdfd = s->cwdfd;
+    cwd = s->cwd;
+    name = s->name;
+    name_copy = s->name_copy;
+    status = s->status;
+    in = serve_null;
+    out = s->out;
+    err = s->err;
+    // the writer may still be bound to a closed session's stream, and a new stream can
+    // come at the same address
+    if (output != NULL) {
+        output->stream = NULL;
+    }
+    while (!s->closing && (line = read_line(&s->r, &len)) != NULL) {
+        if (len > 1) {
+            uint64_t t = trace_start();
+            int ok = tokenize(line, len);
+            trace_end(T_TOKENIZE, "line", t);
+            if (ok) {
+                eval();
+            }
+            arena_reset();
         }
-        split[j] = (char **) realloc(split[j], (j+1) * sizeof(char *));
-        split[j][k] = NULL;
-        count[j] = k-1;
-        j++;
-        k = 0;
+        session_reply(s);
     }
-    // create a pipeline
-    int fd1[2];
-    int fd2[2];
-    if (pipe(fd1) < 0) {
-        perror("pipe");
+    s->cwdfd = cwdfd;
+    s->cwd = cwd;
+    s->name = name;
+    s->name_copy = name_copy;
+    s->status = status;
+    session = NULL;
+    // the client is gone or said exit, or it has to send more
+    if (s->closing || s->r.eof) {
+        session_close(s);
+        return;
     }
-    pipe_start(fd1, 0);
-    for (i = 1; i < args-1; i++) {
-        if (pipe(fd2) < 0) {
-            perror("pipe");
-        }
-        pipe_middle(fd1, fd2, i);
-        memcpy(fd1, fd2, 2*sizeof(int));
+    ev.events = EPOLLIN | EPOLLONESHOT;
+    ev.data.ptr = s;
+    if (epoll_ctl(serve_epoll, EPOLL_CTL_MOD, s->fd, &ev) < 0) {
+        report("epoll_ctl");
+        session_close(s);
     }
-    if (args < 3) {
-        pipe_end(fd1, i);
-    } else {
-        pipe_end(fd2, i);
+}
+//-----------------------------------------------------------------------------------
+// Answer a line: "status output-size error-size\n", the output and the errors; the
+// session's streams then start over
+//-----------------------------------------------------------------------------------
+void session_reply(struct session *s) {
+    char head[64];
+    int fo = fileno(s->out), fe = fileno(s->err);
+    out_flush();
+    off_t no = lseek(fo, 0, SEEK_END), ne = lseek(fe, 0, SEEK_END);
+    int len = snprintf(head, sizeof(head), "%d %lld %lld\n", status, (long long) no, (long long) ne);
+    if (no < 0 || ne < 0 || session_send(s, -1, head, len) < 0
+            || session_send(s, fo, NULL, no) < 0 || session_send(s, fe, NULL, ne) < 0) {
+        s->closing = 1;
+    }
+    // copies that write at the file position must find it at the start again
+    if (ftruncate(fo, 0) < 0 || ftruncate(fe, 0) < 0 || lseek(fo, 0, SEEK_SET) < 0 || lseek(fe, 0, SEEK_SET) < 0) {
+        report("ftruncate");
+        s->closing = 1;
     }
-    fflush(stdout);
 }
-//-----------------------
-// Start of pipeline
-//-----------------------
-void pipe_start(int fd[], int i) {
-    int pid = fork();
-    if (pid < 0) {
-        perror("fork");
-    } else if (pid == 0) {
-        // redirect child's standard output to the writing end of the 1st pipe
-        if (dup2(fd[1], 1) < 0) {
-            perror("dup2");
+//-----------------------------------------------------------------------------------
+// Send len bytes of buf, or of the memfd fd when buf is NULL, waiting while the
+// client's socket is full
+//-----------------------------------------------------------------------------------
+int session_send(struct session *s, int fd, char *buf, size_t len) {
+    struct pollfd p = {s->fd, POLLOUT, 0};
+    off_t off = 0;
+    ssize_t n;
+    while (len > 0) {
+        n = buf != NULL ? write(s->fd, buf, len) : sendfile(s->fd, fd, &off, len);
+        if (n < 0 && errno == EAGAIN) {
+            poll(&p, 1, -1);
+            continue;
         }
-        // close the descriptors
-        if (close(fd[0]) < 0) {
-            perror("close");
+        if (n < 0 && errno == EINTR) {
+            continue;
         }
-        if (close(fd[1]) < 0) {
-            perror("close");
+        if (n <= 0) {
+            return -1;
         }
-        if (fun_exec_internal(i) == 1) {
-            exit(EXIT_SUCCESS);
+        if (buf != NULL) {
+            buf += n;
         }
-        execvp(split[i][0], split[i]);
-        perror("execvp");
-        exit(EXIT_FAILURE);
-     }
+        len -= n;
+    }
+    return 0;
 }
-//-----------------------
-// Middle of pipeline
-//-----------------------
-void pipe_middle(int fd1[], int fd2[], int i) {
-    int pid = fork();
+//-----------------------------------------------------------------------------------
+// End a session; closing its socket takes it out of the epoll set
+//-----------------------------------------------------------------------------------
+void session_close(struct session *s) {
+    if (s->out != NULL) {
+        if (output != NULL && output->stream == s->out) {
+            output->stream = NULL;
+        }
+        fclose(s->out);
+    }
+    if (s->err != NULL) {
+        fclose(s->err);
+    }
+    if (s->cwdfd >= 0) {
+        close(s->cwdfd);
+    }
+    free(s->cwd);
+    free(s->name_copy);
+    free(s->r.buf);
+    close(s->fd);
+    free(s);
+}
+//-----------------------------------------------------------------------------------
+// Fork the zygote, connected to the shell by a socket of messages
+//-----------------------------------------------------------------------------------
+void zygote_start() {
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) < 0) {
+        report("socketpair");
+        return;
+    }
+    pid_t pid = fork();
     if (pid < 0) {
-        perror("fork");
+        report("fork");
+        close(sv[0]);
+        close(sv[1]);
+        return;
     } else if (pid == 0) {
-        // redirect child's standard input to the reading end of the 1st pipe
-        if (dup2(fd1[0], 0) < 0) {
-            perror("dup2");
-        }
-        // redirect child's standard output to the writing end of the 2nd pipe
-        if (dup2(fd2[1], 1) < 0) {
-            perror("dup2");
-        }
-        // close the descriptors
-        if (close(fd1[0]) < 0) {
-            perror("close");
-        }
-        if (close(fd1[1]) < 0) {
-            perror("close");
+        close(sv[0]);
+        zygote_run(sv[1]);
+    }
+    close(sv[1]);
+    zygote = sv[0];
+    // a forked shell's commands must be its own children, not the shell's
+    pthread_atfork(NULL, NULL, zygote_forget);
+}
+//-----------------------------------------------------------------------------------
+// Zygote: for every message (path, arguments, and the standard descriptors and the
+// directory as SCM_RIGHTS) clone a child of the shell that runs the command, and
+// answer with its pid and the error of exec; ends with the shell
+//-----------------------------------------------------------------------------------
+void zygote_run(int sock) {
+    static char buf[ZYGOTE_MSG + 1];
+    static char *argv[ZYGOTE_MSG / 2 + 1];
+    union {
+        char buf[CMSG_SPACE(4 * sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct iovec iov = {buf, ZYGOTE_MSG};
+    struct msghdr msg;
+    struct cmsghdr *c;
+    int i, fds[4], reply[2], pipefd[2];
+    ssize_t n;
+    while (1) {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control.buf;
+        msg.msg_controllen = sizeof(control.buf);
+        if ((n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC)) <= 0) {
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            _exit(0);
         }
-        if (close(fd2[0]) < 0) {
-            perror("close");
+        fds[0] = fds[1] = fds[2] = fds[3] = -1;
+        if ((c = CMSG_FIRSTHDR(&msg)) != NULL && c->cmsg_type == SCM_RIGHTS && c->cmsg_len == CMSG_LEN(sizeof(fds))) {
+            memcpy(fds, CMSG_DATA(c), sizeof(fds));
         }
-        if (close(fd2[1]) < 0) {
-            perror("close");
+        // the path, then the arguments
+        buf[n] = '\0';
+        char *p = buf + strlen(buf) + 1;
+        for (i = 0; p < buf + n; i++) {
+            argv[i] = p;
+            p += strlen(p) + 1;
         }
-        if (fun_exec_internal(i) == 1) {
-            exit(EXIT_SUCCESS);
+        argv[i] = NULL;
+        reply[0] = -1;
+        reply[1] = 0;
+        if (fds[3] < 0) {
+            reply[1] = EBADF;
+        } else if (pipe2(pipefd, O_CLOEXEC) < 0) {
+            reply[1] = errno;
+        // CLONE_PARENT: the shell waits for the command like for one it spawned
+        } else if ((reply[0] = syscall(SYS_clone, CLONE_PARENT | SIGCHLD, 0, NULL, NULL, 0)) < 0) {
+            reply[1] = errno;
+            close(pipefd[0]);
+            close(pipefd[1]);
+        } else if (reply[0] == 0) {
+            int e;
+            if (dup2(fds[0], 0) < 0 || dup2(fds[1], 1) < 0 || dup2(fds[2], 2) < 0 || fchdir(fds[3]) < 0) {
+                e = errno;
+            } else {
+                execve(buf, argv, environ);
+                e = errno;
+            }
+            if (write(pipefd[1], &e, sizeof(e)) < 0) {
+                _exit(126);
+            }
+            _exit(127);
+        } else {
+            // exec closes the pipe, a failure writes its error into it
+            close(pipefd[1]);
+            if (read(pipefd[0], &reply[1], sizeof(reply[1])) != sizeof(reply[1])) {
+                reply[1] = 0;
+            }
+            close(pipefd[0]);
         }
-        execvp(split[i][0], split[i]);
-        perror("execvp");
-        exit(EXIT_FAILURE);
-    } else {
-        // close the descriptors
-        if (close(fd1[0]) < 0) {
-            perror("close");
+        for (i = 0; i < 4; i++) {
+            if (fds[i] >= 0) {
+                close(fds[i]);
+            }
         }
-        if (close(fd1[1]) < 0) {
-            perror("close");
+        if (send(sock, reply, sizeof(reply), MSG_NOSIGNAL) < 0) {
+            _exit(0);
         }
     }
 }
-//-----------------------
-// End of pipeline
-//-----------------------
-void pipe_end(int fd[], int i) {
-    int pid = fork();
-    if (pid < 0) {
-        perror("fork");
-    } else if (pid == 0) {
-        // redirect child's standard input to the reading end of the 2nd pipe
-        if (dup2(fd[0], 0) < 0) {
-            perror("dup2");
-        }
-        // close the descriptors
-        if (close(fd[0]) < 0) {
-            perror("close");
-        }
-        if (close(fd[1]) < 0) {
-            perror("close");
-        }
-        if (fun_exec_internal(i) == 1) {
-            exit(EXIT_SUCCESS);
+//-----------------------------------------------------------------------------------
+// Have the zygote start a command with the thread's descriptors and directory;
+// 0 or the error of exec, or -1 when the zygote can't take the command
+//-----------------------------------------------------------------------------------
+int zygote_spawn(pid_t *pid, char *path, char **argv, int fdin, int fdout) {
+    char buf[ZYGOTE_MSG];
+    size_t size = 0, len;
+    int i, fds[4] = {fdin, fdout, fileno(err), cwdfd}, reply[2];
+    union {
+        char buf[CMSG_SPACE(sizeof(fds))];
+        struct cmsghdr align;
+    } control;
+    // the path, then the arguments, each with its terminator
+    for (i = -1; i < 0 || argv[i] != NULL; i++) {
+        char *arg = i < 0 ? path : argv[i];
+        if (size + (len = strlen(arg) + 1) > sizeof(buf)) {
+            return -1;
         }
-        execvp(split[i][0], split[i]);
-        perror("execvp");
-        exit(EXIT_FAILURE);
-     } else {
-         // close the descriptors
-         if (close(fd[0]) < 0) {
-             perror("close");
-         }
-         if (close(fd[1]) < 0) {
-             perror("close");
-         }
-         while (waitpid(-1, NULL, 0) > 0) { }
+        memcpy(buf + size, arg, len);
+        size += len;
+    }
+    // the shell's own directory goes as a descriptor too
+    if (cwdfd == AT_FDCWD && (fds[3] = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC)) < 0) {
+        return errno;
+    }
+    struct iovec iov = {buf, size};
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    struct cmsghdr *c = CMSG_FIRSTHDR(&msg);
+    c->cmsg_level = SOL_SOCKET;
+    c->cmsg_type = SCM_RIGHTS;
+    c->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(c), fds, sizeof(fds));
+    // one command at a time, sessions take turns
+    pthread_mutex_lock(&zygote_lock);
+    ssize_t n = zygote < 0 ? -1 : sendmsg(zygote, &msg, MSG_NOSIGNAL);
+    if (n >= 0) {
+        do {
+            n = recv(zygote, reply, sizeof(reply), 0);
+        } while (n < 0 && errno == EINTR);
+    }
+    // without the zygote the shell spawns the commands itself
+    if (n != sizeof(reply) && zygote >= 0 && !(n < 0 && errno == EMSGSIZE)) {
+        report("zygote");
+        close(zygote);
+        zygote = -1;
+    }
+    pthread_mutex_unlock(&zygote_lock);
+    if (cwdfd == AT_FDCWD) {
+        close(fds[3]);
     }
+    if (n != sizeof(reply)) {
+        return -1;
+    }
+    *pid = reply[0];
+    // a child that failed to exec has exited already
+    if (reply[1] != 0 && reply[0] > 0) {
+        waitpid(reply[0], NULL, 0);
+    }
+    return reply[1];
 }
 //-----------------------------------------------------------------------------------
-// Execute external command in foreground
+// A forked shell spawns its commands itself
 //-----------------------------------------------------------------------------------
-void fun_exec_front(int *opt) {
-    int n;
-    int pid = fork();
-    // error
-    if (pid < 0) {
-        perror("fork");
-    // child
-    } else if (pid == 0) {
-        n = token_count - (opt[0]+opt[1]);
-        tokens = (char **) realloc(tokens, (n+1) * sizeof(char *));
-        tokens[n] = NULL;
-        execvp(tokens[0], tokens);
-        perror("execvp");
-        exit(EXIT_FAILURE);
-    // parent
-    } else {
-        // wait until the child exits
-        int stat;
-        if (waitpid(pid, &stat, 0) < 0) {
-            perror("waitpid");
+void zygote_forget() {
+    if (zygote >= 0) {
+        close(zygote);
+        zygote = -1;
+    }
+    pthread_mutex_init(&zygote_lock, NULL);
+}
+//-----------------------------------------------------------------------------------
+// Run the rest of the line with its output kept in memory as name, for <@name;
+// without a command list the captures and their sizes, -r name drops one
+//-----------------------------------------------------------------------------------
+int fun_capture(int args) {
+    struct capture **c, *next;
+    struct stat st;
+    if (args == 0) {
+        pthread_mutex_lock(&capture_lock);
+        for (next = captures; next != NULL; next = next->next) {
+            if (fstat(next->fd, &st) == 0) {
+                fprintf(out, "%s\t%lld\n", next->name, (long long) st.st_size);
+            }
+        }
+        pthread_mutex_unlock(&capture_lock);
+        return 0;
+    }
+    if (args < 2) {
+        fprintf(err, "usage: capture name command... | capture -r name\n");
+        return 1;
+    }
+    if (strcmp(tokens[1], "-r") == 0) {
+        pthread_mutex_lock(&capture_lock);
+        if ((next = *(c = capture_find(tokens[2]))) != NULL) {
+            *c = next->next;
+            close(next->fd);
+            free(next->name);
+            free(next);
+        }
+        pthread_mutex_unlock(&capture_lock);
+        if (next == NULL) {
+            fprintf(err, "%s: no such capture\n", tokens[2]);
+            return 1;
         }
-        // check if child exited with exit() and obtain the exit status
-        if (WIFEXITED(stat) > 0) {
-            status = WEXITSTATUS(stat);
+        return 0;
+    }
+    // the command writes to a stream of its own on the memfd, which stays open
+    int fd = memfd_create("capture", MFD_CLOEXEC), copy;
+    FILE *saved = out;
+    if (fd < 0) {
+        report("memfd_create");
+        return 1;
+    }
+    if ((copy = fcntl(fd, F_DUPFD_CLOEXEC, 0)) < 0 || (out = fdopen(copy, "w")) == NULL) {
+        report("fdopen");
+        if (copy >= 0) {
+            close(copy);
         }
+        close(fd);
+        out = saved;
+        return 1;
+    }
+    // like time, the command is the rest of the line
+    char **line = tokens;
+    int stat;
+    tokens += 2;
+    int b = find_builtin(tokens[0]);
+    if (b < 0) {
+        fun_exec_front(args - 2, NULL, 0);
+        stat = status;
+    } else if (args - 2 < builtins[b].args) {
+        fprintf(err, "%s: missing operand\n", builtins[b].name);
+        stat = EXIT_FAILURE;
+    } else {
+        stat = builtins[b].fun(args - 2);
+    }
+    tokens = line;
+    out_close();
+    out = saved;
+    if (capture_keep(tokens[1], fd) < 0) {
+        close(fd);
+        return 1;
     }
+    return stat;
 }
 //-----------------------------------------------------------------------------------
-// Execute external command in background
+// The link to the capture with the name, or to the end of the list; with capture_lock
 //-----------------------------------------------------------------------------------
-void fun_exec_back(int *opt) {
-    int n;
-    int pid = fork();
-    // error
-    if (pid < 0) {
-        perror("fork");
-    // child
-    } else if (pid == 0) {
-        n = token_count-(opt[0]+opt[1])-1;
-        tokens = (char **) realloc(tokens, (n+1) * sizeof(char *));
-        tokens[n] = NULL;
-        execvp(tokens[0], tokens);
-        perror("execvp");
-        exit(EXIT_FAILURE);
+struct capture **capture_find(char *name) {
+    struct capture **c = &captures;
+    while (*c != NULL && strcmp((*c)->name, name) != 0) {
+        c = &(*c)->next;
     }
+    return c;
 }
 //-----------------------------------------------------------------------------------
-// Catch daemon exit statuses
+// Keep the memfd as the capture with the name, replacing an older one
 //-----------------------------------------------------------------------------------
-void handler(int signum) {
-    waitpid(WAIT_ANY, NULL, WNOHANG);
+int capture_keep(char *name, int fd) {
+    struct capture **c, *n;
+    pthread_mutex_lock(&capture_lock);
+    if ((n = *(c = capture_find(name))) != NULL) {
+        close(n->fd);
+        n->fd = fd;
+    } else if ((n = (struct capture *) malloc(sizeof(struct capture))) == NULL || (n->name = strdup(name)) == NULL) {
+        report("malloc");
+        free(n);
+        pthread_mutex_unlock(&capture_lock);
+        return -1;
+    } else {
+        n->next = NULL;
+        n->fd = fd;
+        *c = n;
+    }
+    pthread_mutex_unlock(&capture_lock);
+    return 0;
 }
 //-----------------------------------------------------------------------------------
-// Call internal function in pipeline
+// A descriptor reading the capture with the name from its start; opened anew through
+// /proc, so every reader has an offset of its own and nothing is copied
 //-----------------------------------------------------------------------------------
-int fun_exec_internal(int index) {
-    tokens = split[index];
-    char *com = tokens[0];
-    int i = count[index];
-    // NAME
-    if (strcmp(com, "name") == 0) {
-        fun_name(i);
-    	return 1;
-    // HELP
-    } else if (strcmp(com, "help") == 0) {
-        fun_help();
-	    return 1;
-    // STATUS
-    } else if (strcmp(com, "status") == 0) {
-        fun_status();
-    	return 1;
-    // EXIT
-    } else if (strcmp(com, "exit") == 0) {
-        fun_exit(i);
-	    return 1;
-    // PRINT
-    } else if (strcmp(com, "print") == 0) {
-        fun_print(i);
-    	return 1;
-    // ECHO
-    } else if (strcmp(com, "echo") == 0) {
-        fun_echo(i);
-	    return 1;
-    // PID
-    } else if (strcmp(com, "pid") == 0) {
-    	fun_pid();
-    	return 1;
-    // PPID
-    } else if (strcmp(com, "ppid") == 0) {
-    	fun_ppid();
-    	return 1;
-    // DIR
-    } else if (strcmp(com, "dir") == 0) {
-        fun_dir(i);
-	    return 1;
-    // DIRWHERE
-    } else if (strcmp(com, "dirwhere") == 0) {
-	    fun_dirwhere();
-	    return 1;
-    // DIRMAKE
-    } else if (strcmp(com, "dirmake") == 0) {
-    	fun_dirmake();
-    	return 1;
-    // DIRREMOVE
-    } else if (strcmp(com, "dirremove") == 0) {
-    	fun_dirremove();
-    	return 1;
-    // DIRLIST
-    } else if (strcmp(com, "dirlist") == 0) {
-    	fun_dirlist(i);
-    	return 1;
-    // LINKHARD
-    } else if (strcmp(com, "linkhard") == 0) {
-    	fun_linkhard();
-    	return 1;
-    // LINKSOFT
-    } else if (strcmp(com, "linksoft") == 0) {
-    	fun_linksoft();
-    	return 1;
-    // LINKREAD
-    } else if (strcmp(com, "linkread") == 0) {
-    	fun_linkread();
-	    return 1;
-    // LINKLIST
-    } else if (strcmp(com, "linklist") == 0) {
-    	fun_linklist();
-	    return 1;
-    // UNLINK
-    } else if (strcmp(com, "unlink") == 0) {
-    	fun_unlink();
-    	return 1;
-    // RENAME
-    } else if (strcmp(com, "rename") == 0) {
-    	fun_rename();
-    	return 1;
-    // CPCAT
-    } else if (strcmp(com, "cpcat") == 0) {
-    	fun_cpcat(i);
-    	return 1;
+int capture_open(char *name) {
+    struct capture *c;
+    char path[64];
+    int fd = -1;
+    pthread_mutex_lock(&capture_lock);
+    if ((c = *capture_find(name)) == NULL) {
+        fprintf(err, "%s: no such capture\n", name);
+    } else {
+        snprintf(path, sizeof(path), "/proc/self/fd/%d", c->fd);
+        if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0) {
+            report("open");
+        }
     }
-    return 0;
+    pthread_mutex_unlock(&capture_lock);
+    return fd;
 }